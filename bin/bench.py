@@ -0,0 +1,31 @@
+# Measures per-call overhead of the Device methods.
+# Without arguments the device is not opened, so the calls return without any USB I/O
+# and only the cost of the Python/C boundary is measured.
+# usage: python bench.py [device_name]
+import sys
+import timeit
+
+import py_ftdi
+
+NUMBER = 200000
+REPEAT = 5
+
+dev = py_ftdi.Device()
+if len(sys.argv) > 1:
+    print("open:", dev.open(sys.argv[1], 0, 0))
+
+data = b"\x55\x01\x00\x00\xAA"
+buff = bytearray(2)
+
+calls = [
+    ("is_connected()", lambda: dev.is_connected()),
+    ("send(bytes)", lambda: dev.send(data)),
+    ("read(2, 0)", lambda: dev.read(2, 0)),
+    ("read_into(buff, 0)", lambda: dev.read_into(buff, 0)),
+]
+
+for name, func in calls:
+    best = min(timeit.repeat(func, number=NUMBER, repeat=REPEAT)) / NUMBER
+    print(f"{name:24s} {best * 1e9:8.1f} ns/call")
+
+dev.close()
@@ -1,13 +1,92 @@
+from types import TracebackType
+from typing import Awaitable, Callable, Iterable, Iterator, Literal, Sequence, TypedDict, overload
+
+DT_CHAR: int
+DT_BYTE: int
+DT_I16: int
+DT_U16: int
+DT_I32: int
+DT_U32: int
+DT_I64: int
+DT_U64: int
+DT_FLOAT: int
+DT_DOUBLE: int
+DT_BOOL: int
+FRAME_NONE: int
+FRAME_FIXED: int
+FRAME_LENGTH: int
+FRAME_DELIMITER: int
+
 
 def list_devices() -> list[str]: ...
 
 
+class FifoStreamStats(TypedDict):
+    total_bytes: int
+    total_time: float
+    total_rate: float
+    current_rate: float
+    running: bool
+
+
+class DeviceStream(Iterator[memoryview]):
+    rc: int
+    def __iter__(self) -> DeviceStream: ...
+    def __next__(self) -> memoryview: ...
+    def close(self) -> None: ...
+    def __enter__(self) -> DeviceStream: ...
+    def __exit__(self, exc_type: type[BaseException] | None, exc: BaseException | None, tb: TracebackType | None) -> bool: ...
+
+
 class Device:
     def __init__(self) -> None: ...
     def open(self, dev_name: str, baud: int, interface_index: int) -> int: ...
     def close(self) -> int: ...
     def set_sync_mode(self, is_sync_mode: bool) -> int: ...
+    def set_read_pipeline(self, depth: int, transfer_size: int = 65536) -> int: ...
+    def start_reader(self, ring_size: int = 4194304) -> int: ...
+    def stop_reader(self) -> None: ...
+    def in_queue(self) -> int: ...
+    def start_writer(self, queue_size: int = 1048576, timeout: float = 2) -> int: ...
+    def stop_writer(self) -> int: ...
+    def flush(self, timeout: float = 2) -> int: ...
+    def tx_token(self) -> int: ...
+    def wait_sent(self, token: int, timeout: float = 2) -> int: ...
     def is_connected(self) -> bool: ...
     def clear_buffers(self) -> int: ...
-    def send(self, data: list[int]) -> int: ...
-    def read(self, size: int, timeout: float) -> tuple[int, list[int]]: ...
+    def send(self, data: list[int] | bytes | bytearray | memoryview) -> int: ...
+    def send_parts(self, parts: Sequence[list[int] | bytes | bytearray | memoryview], timeout: float = 2) -> int: ...
+    @overload
+    def read(self, size: int, timeout: float, as_list: Literal[False] = False) -> tuple[int, bytes]: ...
+    @overload
+    def read(self, size: int, timeout: float, as_list: Literal[True]) -> tuple[int, list[int]]: ...
+    def read_into(self, buffer: bytearray | memoryview, timeout: float) -> int: ...
+    def read_until(self, pattern: bytes | bytearray | memoryview, max_size: int, timeout: float = 2) -> tuple[int, bytes]: ...
+    def skip_until(self, pattern: bytes | bytearray | memoryview, timeout: float = 2) -> int: ...
+    def expect(self, patterns: Sequence[bytes | bytearray | memoryview], timeout: float = 2) -> tuple[int, int]: ...
+    def readline(self, sep: bytes = b"\n", timeout: float = 2) -> tuple[int, bytes]: ...
+    def readlines(self, max_lines: int = 0, timeout: float = 2, sep: bytes = b"\n") -> tuple[int, list[bytes]]: ...
+    def set_framing(self, kind: int, size: int = 0, length_offset: int = 0, length_width: Literal[1, 2, 4, 8] = 1, endianness: Literal["little", "big"] = "little", length_adjust: int = 0, delimiter: bytes = b"", sync: bytes = b"", max_size: int = 0) -> int: ...
+    def read_frames(self, max_frames: int = 0, timeout: float = 2) -> tuple[int, list[tuple[bytes, float]]]: ...
+    def framing_dropped(self) -> int: ...
+    def read_array(self, count: int, dtype: int, endianness: Literal["little", "big"], timeout: float) -> tuple[int, memoryview]: ...
+    def send_array(self, array: memoryview | bytes | bytearray, endianness: Literal["little", "big"]) -> int: ...
+    def set_on_data(self, callback: Callable[[bytes, bool], object] | None, max_batch_bytes: int = 65536, max_latency_ms: float = 50, tx: bool = False) -> None: ...
+    def start_fifo_stream(self, callback: Callable[[bytes], object], max_batch_bytes: int = 1048576, max_latency_ms: float = 50, packets_per_transfer: int = 8, num_transfers: int = 256) -> int: ...
+    def stop_fifo_stream(self) -> int: ...
+    def fifo_stream_stats(self) -> FifoStreamStats: ...
+    def read_async(self, size: int, timeout: float) -> Awaitable[tuple[int, bytes]]: ...
+    def send_async(self, data: list[int] | bytes | bytearray | memoryview, timeout: float = 2) -> Awaitable[int]: ...
+    def transact(self, items: list[tuple[list[int] | bytes | bytearray | memoryview, int]], timeout: float = 2, window: int = 0) -> tuple[int, bytes, list[int]]: ...
+    def exchange(self, data: list[int] | bytes | bytearray | memoryview, timeout: float = 2, window: int = 0) -> tuple[int, bytes]: ...
+    def stream(self, chunk_size: int, timeout: float = 2, buffers: int = 4) -> DeviceStream: ...
+
+
+class DeviceGroup:
+    def __init__(self, devices: Iterable[Device]) -> None: ...
+    def __len__(self) -> int: ...
+    @property
+    def devices(self) -> tuple[Device, ...]: ...
+    def send(self, data: list[int] | bytes | bytearray | memoryview | Sequence[list[int] | bytes | bytearray | memoryview], timeout: float = 2) -> list[int]: ...
+    def read(self, size: int | Sequence[int], timeout: float) -> list[tuple[int, bytes]]: ...
+    def transact(self, data: list[int] | bytes | bytearray | memoryview | Sequence[list[int] | bytes | bytearray | memoryview], size: int | Sequence[int], timeout: float = 2) -> list[tuple[int, bytes]]: ...
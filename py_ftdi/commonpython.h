@@ -26,6 +26,101 @@
     #define PyString_FromString PyUnicode_FromString
 #endif
 
+#include <climits>
+
+// critical sections guard objects in free-threaded builds (3.13+), with the GIL they are not needed
+#ifndef Py_BEGIN_CRITICAL_SECTION
+    #define Py_BEGIN_CRITICAL_SECTION(op) {
+    #define Py_END_CRITICAL_SECTION() }
+#endif
+
+#define PyFastCFunction(func) ((PyCFunction)(void(*)(void))(func))
+
+// Matches arguments of METH_FASTCALL | METH_KEYWORDS function to the names in kwlist (NULL terminated).
+// Found arguments are stored to values (borrowed references), missing optional ones are NULL.
+inline int pyParseArgs(PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames, const char* funcName,
+                       const char* const kwlist[], Py_ssize_t required, PyObject* values[])
+{
+    Py_ssize_t count = 0;
+    while (kwlist[count])
+        count++;
+
+    if (nargs > count) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd arguments (%zd given)", funcName, count, nargs);
+        return 0;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++)
+        values[i] = i < nargs ? args[i] : NULL;
+
+    Py_ssize_t kwcount = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (Py_ssize_t k = 0; k < kwcount; k++) {
+        PyObject* key = PyTuple_GET_ITEM(kwnames, k);
+        Py_ssize_t i = 0;
+        while (i < count && PyUnicode_CompareWithASCIIString(key, kwlist[i]) != 0)
+            i++;
+        if (i == count) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", funcName, key);
+            return 0;
+        }
+        if (values[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", funcName, kwlist[i]);
+            return 0;
+        }
+        values[i] = args[nargs + k];
+    }
+
+    for (Py_ssize_t i = 0; i < required; i++) {
+        if (!values[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s' (pos %zd)", funcName, kwlist[i], i + 1);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// argument converters, return 0 and set exception on error
+inline int pyArgInt(PyObject* obj, int* val)
+{
+    long v = PyLong_AsLong(obj);
+    if (v == -1 && PyErr_Occurred())
+        return 0;
+    if (v > INT_MAX || v < INT_MIN) {
+        PyErr_SetString(PyExc_OverflowError, "Value does not fit into int.");
+        return 0;
+    }
+    *val = (int)v;
+    return 1;
+}
+
+inline int pyArgSize(PyObject* obj, Py_ssize_t* val)
+{
+    *val = PyNumber_AsSsize_t(obj, PyExc_OverflowError);
+    return !(*val == -1 && PyErr_Occurred());
+}
+
+inline int pyArgDouble(PyObject* obj, double* val)
+{
+    *val = PyFloat_AsDouble(obj);
+    return !(*val == -1.0 && PyErr_Occurred());
+}
+
+inline int pyArgBool(PyObject* obj, int* val)
+{
+    *val = PyObject_IsTrue(obj);
+    return *val >= 0;
+}
+
+inline int pyArgString(PyObject* obj, const char** val)
+{
+    if (!PyUnicode_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "expected str, got %s", Py_TYPE(obj)->tp_name);
+        return 0;
+    }
+    *val = PyUnicode_AsUTF8(obj);
+    return *val != NULL;
+}
+
 
 #endif /* !COMMONPYTHON_H */
 
@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) 2026 Daniel Turecek
+ *
+ * @file      dataconv.cpp
+ * @author    Daniel Turecek <daniel@turecek.de>
+ * @date      2026-10-16
+ *
+ */
+#include "dataconv.h"
+#include <cstring>
+
+// byte swap loops are vectorized by the compiler. With GCC/Clang on x86-64 ELF
+// targets several versions are compiled and the best one is selected at load time.
+#if defined(__x86_64__) && defined(__ELF__) && defined(__has_attribute)
+    #if __has_attribute(target_clones)
+        #define DATACONV_SIMD __attribute__((target_clones("avx2", "ssse3", "default")))
+    #endif
+#endif
+#ifndef DATACONV_SIMD
+    #define DATACONV_SIMD
+#endif
+
+#ifdef _MSC_VER
+    #include <stdlib.h>
+    #define bswap16(x) _byteswap_ushort(x)
+    #define bswap32(x) _byteswap_ulong(x)
+    #define bswap64(x) _byteswap_uint64(x)
+#else
+    #define bswap16(x) __builtin_bswap16(x)
+    #define bswap32(x) __builtin_bswap32(x)
+    #define bswap64(x) __builtin_bswap64(x)
+#endif
+
+size_t dataTypeSize(DataType type)
+{
+    switch (type) {
+        case DT_CHAR:   return sizeof(i8);
+        case DT_BYTE:   return sizeof(u8);
+        case DT_I16:    return sizeof(i16);
+        case DT_U16:    return sizeof(u16);
+        case DT_I32:    return sizeof(i32);
+        case DT_U32:    return sizeof(u32);
+        case DT_I64:    return sizeof(i64);
+        case DT_U64:    return sizeof(u64);
+        case DT_FLOAT:  return sizeof(float);
+        case DT_DOUBLE: return sizeof(double);
+        case DT_BOOL:   return sizeof(BOOL);
+        default:        return 0;
+    }
+}
+
+Endianness hostEndianness()
+{
+    const u16 test = 1;
+    return *(const u8*)&test ? ENDIAN_LITTLE : ENDIAN_BIG;
+}
+
+DATACONV_SIMD static void swapBytes16(const u8* src, u8* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        u16 val;
+        memcpy(&val, src + i*2, 2);
+        val = bswap16(val);
+        memcpy(dst + i*2, &val, 2);
+    }
+}
+
+DATACONV_SIMD static void swapBytes32(const u8* src, u8* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        u32 val;
+        memcpy(&val, src + i*4, 4);
+        val = bswap32(val);
+        memcpy(dst + i*4, &val, 4);
+    }
+}
+
+DATACONV_SIMD static void swapBytes64(const u8* src, u8* dst, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        u64 val;
+        memcpy(&val, src + i*8, 8);
+        val = bswap64(val);
+        memcpy(dst + i*8, &val, 8);
+    }
+}
+
+void swapBytes(const void* src, void* dst, size_t count, size_t itemSize)
+{
+    const u8* s = (const u8*)src;
+    u8* d = (u8*)dst;
+    switch (itemSize) {
+        case 2: swapBytes16(s, d, count); break;
+        case 4: swapBytes32(s, d, count); break;
+        case 8: swapBytes64(s, d, count); break;
+        default:
+            if (s != d)
+                memcpy(d, s, count * itemSize);
+    }
+}
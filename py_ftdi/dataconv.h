@@ -0,0 +1,24 @@
+/**
+ * Copyright (C) 2026 Daniel Turecek
+ *
+ * @file      dataconv.h
+ * @author    Daniel Turecek <daniel@turecek.de>
+ * @date      2026-10-16
+ *
+ */
+#ifndef DATACONV_H
+#define DATACONV_H
+#include <cstddef>
+#include "common.h"
+
+enum Endianness {ENDIAN_LITTLE, ENDIAN_BIG};
+
+// size of one element of the data type in bytes, 0 for types without fixed size
+size_t dataTypeSize(DataType type);
+Endianness hostEndianness();
+
+// copies count items of itemSize bytes from src to dst reversing byte order of each item.
+// src and dst may be the same buffer (in place swap), they must not partially overlap.
+void swapBytes(const void* src, void* dst, size_t count, size_t itemSize);
+
+#endif /* end of include guard: DATACONV_H */
@@ -11,7 +11,10 @@
 #include <cstring>
 #include <cstdio>
 #include <algorithm>
+#include "buffer.h"
+#include "matcher.h"
 #include <ctime>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 
@@ -42,6 +45,8 @@ double getPreciseTime();
 
 std::vector<unsigned> FtdiDev::mVidPids;
 std::map<std::string, unsigned> FtdiDev::mNameToVidPid;
+std::mutex FtdiDev::mTablesMutex;
+std::mutex FtdiDev::mEnumMutex;
 
 //########################################################################################################################
 //                                              LIB FTD2XX
@@ -75,13 +80,33 @@ FtdiDev::FtdiDev(std::string nameOrSerial, bool isSerial)
     , mIsSerialPort(false)
     , mLastError("")
     , mExtraData("")
+    , mExtraPos(0)
+    , mInputTotal(0)
+    , mFrameDropped(0)
     , mOnDataFunc(NULL)
     , mOnDataUserData(NULL)
+    , mReadPipeline(NULL)
+    , mReadDepth(0)
+    , mReadTransferSize(0x10000)
+    , mStreamStop(false)
+    , mReaderRunning(false)
+    , mReaderStop(false)
+    , mReaderDone(false)
+    , mReaderError(0)
+    , mWriterRunning(false)
+    , mWriterStop(false)
+    , mWriterError(0)
+    , mWriterTimeout(2)
+    , mTxQueued(0)
+    , mTxSent(0)
+    , mRxEvent(NULL)
 {
 }
 
 FtdiDev::~FtdiDev()
 {
+    stopWriter();
+    stopReader();
 }
 
 inline bool isValidDevice(const char* desc, const char* filters[], size_t size, bool ignoreB)
@@ -100,6 +125,7 @@ inline bool isValidDevice(const char* desc, const char* filters[], size_t size,
 
 int FtdiDev::listDevicesByNameFast(const char* filters[], size_t size, std::vector<FtdiDevInfo> &devices, bool ignoreB, bool getSerial)
 {
+    std::lock_guard<std::mutex> enumLock(mEnumMutex);
     DWORD devCount = 0;
     FT_STATUS fts = FT_OK;
     char* buffers[51];
@@ -130,11 +156,12 @@ int FtdiDev::listDevicesByNameFast(const char* filters[], size_t size, std::vect
 
 #ifndef WIN32
     // on Mac and Linux - list special VID PID devices:
-    if (!mVidPids.empty()){
-        for (unsigned vp = 0; vp < mVidPids.size(); vp++){
+    std::vector<unsigned> vps = vidPids();
+    if (!vps.empty()){
+        for (unsigned vp = 0; vp < vps.size(); vp++){
             DWORD oldVID = 0, oldPID = 0;
-            unsigned vid = (mVidPids[vp] >> 16) & 0xFFFF;
-            unsigned pid = mVidPids[vp] & 0xFFFF;
+            unsigned vid = (vps[vp] >> 16) & 0xFFFF;
+            unsigned pid = vps[vp] & 0xFFFF;
             FT_GetVIDPID(&oldVID, &oldPID);
             FT_SetVIDPID(vid, pid);
 
@@ -165,7 +192,7 @@ int FtdiDev::listDevicesByNameFast(const char* filters[], size_t size, std::vect
 
                     if (!exists){
                         devices.push_back(devInfo);
-                        mNameToVidPid[std::string(getSerial ? devInfo.serial : devInfo.name)] = mVidPids[vp];
+                        setNameVidPid(getSerial ? devInfo.serial : devInfo.name, vps[vp]);
                     }
                 }
             }
@@ -184,6 +211,7 @@ int FtdiDev::listDevicesByNameFast(const char* filters[], size_t size, std::vect
 int FtdiDev::listDevicesByName(const char* filters[], size_t size, std::vector<FtdiDevInfo> &devices, bool ignoreB, bool getSerial)
 {
     (void)getSerial;
+    std::lock_guard<std::mutex> enumLock(mEnumMutex);
     DWORD devCount = 0;
     FT_STATUS fts = FT_OK;
 
@@ -209,11 +237,12 @@ int FtdiDev::listDevicesByName(const char* filters[], size_t size, std::vector<F
 
     // on Mac and Linux - list devices with special VID and PID
     #ifndef WIN32
-    if (!mVidPids.empty()){
-        for (unsigned vp = 0; vp < mVidPids.size(); vp++){
+    std::vector<unsigned> vps = vidPids();
+    if (!vps.empty()){
+        for (unsigned vp = 0; vp < vps.size(); vp++){
             DWORD oldVID = 0, oldPID = 0;
-            unsigned vid = (mVidPids[vp] >> 16) & 0xFFFF;
-            unsigned pid = mVidPids[vp] & 0xFFFF;
+            unsigned vid = (vps[vp] >> 16) & 0xFFFF;
+            unsigned pid = vps[vp] & 0xFFFF;
             FT_GetVIDPID(&oldVID, &oldPID);
             FT_SetVIDPID(vid, pid);
 
@@ -242,7 +271,7 @@ int FtdiDev::listDevicesByName(const char* filters[], size_t size, std::vector<F
 
                 if (!exists){
                     devices.push_back(FtdiDevInfo(desc, getSerial ? devInfos[i].SerialNumber : "", devInfos->ID));
-                    mNameToVidPid[std::string(desc)] = mVidPids[vp];
+                    setNameVidPid(desc, vps[vp]);
                 }
 
             }
@@ -259,8 +288,7 @@ int FtdiDev::listDevicesByName(const char* filters[], size_t size, std::vector<F
 int FtdiDev::addVidPid(unsigned vid, unsigned pid)
 {
 #ifndef WIN32
-    mVidPids.push_back(((vid << 16) & 0xFFFF0000) | (pid & 0xFFFF));
-    return 0;
+    return addVidPid(((vid << 16) & 0xFFFF0000) | (pid & 0xFFFF));
 #else
     (void)vid;
     (void)pid;
@@ -271,6 +299,7 @@ int FtdiDev::addVidPid(unsigned vid, unsigned pid)
 int FtdiDev::addVidPid(unsigned vidpid)
 {
 #ifndef WIN32
+    std::lock_guard<std::mutex> lock(mTablesMutex);
     for (size_t i = 0; i < mVidPids.size(); i++){
         if (mVidPids[i] == vidpid)
             return 0;
@@ -283,6 +312,7 @@ int FtdiDev::addVidPid(unsigned vidpid)
 
 int FtdiDev::listDevicesByVidpid(unsigned long vidpids[], size_t size, std::vector<FtdiDevInfo> &devices, bool ignoreB)
 {
+    std::lock_guard<std::mutex> enumLock(mEnumMutex);
     // add vid pids to table (needed for Mac and Linux)
 #ifndef WIN32
     for (unsigned i = 0; i < size; i++)
@@ -316,12 +346,82 @@ int FtdiDev::listDevicesByVidpid(unsigned long vidpids[], size_t size, std::vect
 }
 
 
+// Event signalled by the driver when data are received, waits for data block on it
+// instead of polling the queue. Freed after the device is closed.
+static void* rxEventCreate(FT_HANDLE handle)
+{
+#ifdef WIN32
+    HANDLE event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!event)
+        return NULL;
+    if (FT_SetEventNotification(handle, FT_EVENT_RXCHAR, event) != FT_OK) {
+        CloseHandle(event);
+        return NULL;
+    }
+    return event;
+#else
+    EVENT_HANDLE* event = new EVENT_HANDLE;
+    pthread_mutex_init(&event->eMutex, NULL);
+    pthread_cond_init(&event->eCondVar, NULL);
+    if (FT_SetEventNotification(handle, FT_EVENT_RXCHAR, (PVOID)event) != FT_OK) {
+        pthread_cond_destroy(&event->eCondVar);
+        pthread_mutex_destroy(&event->eMutex);
+        delete event;
+        return NULL;
+    }
+    return event;
+#endif
+}
+
+static void rxEventFree(void* rxEvent)
+{
+    if (!rxEvent)
+        return;
+#ifdef WIN32
+    CloseHandle((HANDLE)rxEvent);
+#else
+    EVENT_HANDLE* event = (EVENT_HANDLE*)rxEvent;
+    pthread_cond_destroy(&event->eCondVar);
+    pthread_mutex_destroy(&event->eMutex);
+    delete event;
+#endif
+}
+
+// waits at most wait seconds for the receive event (without event sleeps shortly)
+static void rxEventWait(FT_HANDLE handle, void* rxEvent, double wait)
+{
+    if (wait <= 0)
+        return;
+    if (!rxEvent) {
+        sleepThreadF(std::min(wait, SLEEPTIME_WIN / 1000.0));
+        return;
+    }
+#ifdef WIN32
+    (void)handle;
+    WaitForSingleObject((HANDLE)rxEvent, (DWORD)std::ceil(wait * 1000));
+#else
+    EVENT_HANDLE* event = (EVENT_HANDLE*)rxEvent;
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long nsec = deadline.tv_nsec + (long long)(wait * 1e9);
+    deadline.tv_sec += (time_t)(nsec / 1000000000);
+    deadline.tv_nsec = (long)(nsec % 1000000000);
+
+    // queue is checked under the lock, so the signal cannot come between check and wait
+    DWORD bytes = 0;
+    pthread_mutex_lock(&event->eMutex);
+    if (FT_GetQueueStatus(handle, &bytes) == FT_OK && bytes == 0)
+        pthread_cond_timedwait(&event->eCondVar, &event->eMutex, &deadline);
+    pthread_mutex_unlock(&event->eMutex);
+#endif
+}
+
 int FtdiDev::openDevice(bool flowControl, unsigned vidpid, unsigned intf)
 {
     (void)vidpid;
+    std::lock_guard<std::mutex> enumLock(mEnumMutex);
 #ifndef WIN32
-    if (mNameToVidPid.find(mNameOrSerial) != mNameToVidPid.end()){
-        unsigned vidpid = mNameToVidPid[mNameOrSerial];
+    if (findNameVidPid(mNameOrSerial, vidpid)){
         unsigned vid = (vidpid >> 16) & 0xFFFF;
         unsigned pid = vidpid & 0xFFFF;
         FT_SetVIDPID(vid, pid);
@@ -339,6 +439,7 @@ int FtdiDev::openDevice(bool flowControl, unsigned vidpid, unsigned intf)
     }
 
     mFlowControl = flowControl;
+    clearInput();
     FT_STATUS fts = FT_OpenEx(const_cast<char*>(nameOrSerial.c_str()),
                               mIsSerial ? FT_OPEN_BY_SERIAL_NUMBER : FT_OPEN_BY_DESCRIPTION,
                               (FT_HANDLE*)&mHandle);
@@ -354,15 +455,20 @@ int FtdiDev::openDevice(bool flowControl, unsigned vidpid, unsigned intf)
         FT_SetFlowControl((FT_HANDLE)mHandle, FT_FLOW_RTS_CTS, 0x0, 0x0);
     // sets the size of usb packets. When used in virtual machines
     // sometimes it is better not to set this.
-    FT_SetUSBParameters((FT_HANDLE)mHandle, 0x10000, 0x10000);
+    FT_SetUSBParameters((FT_HANDLE)mHandle, mReadDepth > 0 ? mReadTransferSize : 0x10000, 0x10000);
+    mRxEvent = rxEventCreate((FT_HANDLE)mHandle);
     return 0;
 }
 
 int FtdiDev::closeDevice()
 {
+    stopWriter();
+    stopReader();
     if (mHandle){
         FT_STATUS fts = FT_Close((FT_HANDLE)mHandle);
         mLastError = FT_ERR_MSG[fts];
+        rxEventFree(mRxEvent);
+        mRxEvent = NULL;
         return fts;
     }
     mHandle = NULL;
@@ -381,6 +487,7 @@ bool FtdiDev::isConnected()
 #define SYNC_MODE  0x40
 int FtdiDev::setBitMode(FtdiBitMode mode)
 {
+    flush(mWriterTimeout);
     FT_STATUS fts = FT_OK;
     if (mode == BIT_ASYNC)
          fts = FT_SetBitMode((FT_HANDLE)mHandle, 0xff, ASYNC_MODE);
@@ -392,6 +499,7 @@ int FtdiDev::setBitMode(FtdiBitMode mode)
 
 int FtdiDev::setBitMode(unsigned char mode1, unsigned char mode2)
 {
+    flush(mWriterTimeout);
     FT_STATUS fts = FT_OK;
     fts = FT_SetBitMode((FT_HANDLE)mHandle, mode1, mode2);
     mLastError = FT_ERR_MSG[fts];
@@ -400,6 +508,7 @@ int FtdiDev::setBitMode(unsigned char mode1, unsigned char mode2)
 
 int FtdiDev::setLatencyTimer(unsigned time)
 {
+    flush(mWriterTimeout);
     FT_STATUS fts = FT_OK;
     fts = FT_SetLatencyTimer((FT_HANDLE)mHandle, time);
     mLastError = FT_ERR_MSG[fts];
@@ -408,6 +517,7 @@ int FtdiDev::setLatencyTimer(unsigned time)
 
 int FtdiDev::setBaudRate(int baudrate)
 {
+    flush(mWriterTimeout);
     FT_SetBaudRate((FT_HANDLE)mHandle, baudrate);
     FT_SetDataCharacteristics((FT_HANDLE)mHandle, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE);
     if (mFlowControl)
@@ -430,6 +540,10 @@ int FtdiDev::cyclePort()
 
 int FtdiDev::inQueue()
 {
+    if (extraSize() > 0)
+        return static_cast<int>(extraSize());
+    if (mReaderRunning || !mRing.empty())
+        return static_cast<int>(mRing.available());
     FT_STATUS fts = FT_OK;
     DWORD bytes;
     fts = FT_GetQueueStatus((FT_HANDLE)mHandle, &bytes);
@@ -440,6 +554,9 @@ int FtdiDev::inQueue()
 
 int FtdiDev::clearBuffers()
 {
+    flush(mWriterTimeout);
+    bool reader = readerPause();
+    clearInput();
     DWORD received = 1;
     char buffer[1000];
     while (received > 0){
@@ -449,9 +566,91 @@ int FtdiDev::clearBuffers()
         }else
             break;
     }
+    if (reader)
+        readerResume();
     return 0;
 }
 
+// FT_Read, served from the ring while the reader thread runs, returns FT status
+int FtdiDev::readQueued(char* buffer, size_t size, size_t* received)
+{
+    if (extraSize() > 0) {
+        *received = (size_t)readExtra(buffer, size);
+        return FT_OK;
+    }
+    if (mReaderRunning || !mRing.empty()) {
+        int rc = readRing(buffer, size, 0);
+        *received = rc > 0 ? (size_t)rc : 0;
+        mInputTotal += *received;
+        return rc < 0 ? -rc : FT_OK;
+    }
+    DWORD got = 0;
+    FT_STATUS fts = FT_Read((FT_HANDLE)mHandle, buffer, static_cast<DWORD>(size), &got);
+    *received = got;
+    mInputTotal += got;
+    return (int)fts;
+}
+
+// waits at most wait seconds for received data, returns number of bytes to read
+int FtdiDev::waitInput(double wait)
+{
+    int bytes = inQueue();
+    if (bytes == 0 && wait > 0) {
+        if (mFlowControl && !mIsSerialPort){
+            FT_SetDtr((FT_HANDLE)mHandle);
+            FT_ClrRts((FT_HANDLE)mHandle);
+        }
+        if (mReaderRunning)
+            readerWait(wait);
+        else
+            rxEventWait((FT_HANDLE)mHandle, mRxEvent, wait);
+        bytes = inQueue();
+    }
+
+    // reader stopped on an error (disconnected device), reported once its data are read
+    if (bytes == 0 && mReaderRunning) {
+        std::lock_guard<std::mutex> lock(mReaderMutex);
+        if (mReaderDone && mReaderError < 0 && mRing.empty()) {
+            mLastError = mReaderMessage;
+            return mReaderError;
+        }
+    }
+    return bytes;
+}
+
+// reads available data, waits at most wait seconds for them (reader thread)
+int FtdiDev::readData(char* buffer, size_t size, double wait, std::string& error)
+{
+    FT_STATUS fts;
+    DWORD bytes = 0, received = 0;
+    double endTime = getPreciseTime() + wait;
+    while (true) {
+        if ((fts = FT_GetQueueStatus((FT_HANDLE)mHandle, &bytes)) != FT_OK) {
+            error = FT_ERR_MSG[fts];
+            return -(int)fts;
+        }
+        if (bytes > 0 || getPreciseTime() >= endTime)
+            break;
+        if (mFlowControl && !mIsSerialPort){
+            FT_SetDtr((FT_HANDLE)mHandle);
+            FT_ClrRts((FT_HANDLE)mHandle);
+        }
+        rxEventWait((FT_HANDLE)mHandle, mRxEvent, endTime - getPreciseTime());
+    }
+    if (bytes == 0)
+        return 0;
+
+    if ((fts = FT_Read((FT_HANDLE)mHandle, buffer, static_cast<DWORD>(std::min((size_t)bytes, size)), &received)) != FT_OK) {
+        error = FT_ERR_MSG[fts];
+        return -(int)fts;
+    }
+    if (mFlowControl && !mIsSerialPort){
+        FT_SetDtr((FT_HANDLE)mHandle);
+        FT_ClrRts((FT_HANDLE)mHandle);
+    }
+    return static_cast<int>(received);
+}
+
 void FtdiDev::logBuff(char* buffer, size_t size, bool rx)
 {
     FILE* f = fopen(mLogFile.c_str(), "a");
@@ -462,26 +661,22 @@ void FtdiDev::logBuff(char* buffer, size_t size, bool rx)
     fclose(f);
 }
 
-int FtdiDev::send(char* buffer, size_t size, double timeout)
+int FtdiDev::writeData(char* buffer, size_t size, double timeout, std::string& error)
 {
     DWORD bytesSent;
     char* buff = buffer;
     size_t sent = 0;
     size_t bytesToSend = size;
-
-    if (!mLogFile.empty())
-        logBuff(buffer, size, false);
-
     double startTime = getPreciseTime();
     do {
         FT_STATUS fts = FT_Write((FT_HANDLE)mHandle, buff, static_cast<DWORD>(std::min((size_t)FT_STEP, bytesToSend)), &bytesSent);
         if (fts != FT_OK) {
-            mLastError = FT_ERR_MSG[fts];
+            error = FT_ERR_MSG[fts];
             return -(int)fts;
         }
 
         if ((unsigned)bytesSent > bytesToSend){
-            mLastError = "Device disconnected";
+            error = "Device disconnected";
             return -1;
         }
 
@@ -489,7 +684,7 @@ int FtdiDev::send(char* buffer, size_t size, double timeout)
         bytesToSend -= (unsigned)bytesSent;
         buff += bytesSent;
         if (getPreciseTime() - startTime > timeout && bytesSent == 0) {
-            mLastError = "Timeout";
+            error = "Timeout";
             return -1;
         }
 
@@ -497,13 +692,10 @@ int FtdiDev::send(char* buffer, size_t size, double timeout)
             startTime = getPreciseTime();
 
     } while (bytesToSend);
-
-    if (mOnDataFunc)
-        mOnDataFunc(buffer, static_cast<unsigned>(sent), true, mOnDataUserData);
     return static_cast<int>(sent);
 }
 
-int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double timeout, bool fixedTimeout)
+int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double timeout, bool fixedTimeout, size_t itemSize)
 {
     if (toReceive > buffSize)
         toReceive = buffSize;
@@ -515,31 +707,18 @@ int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double tim
 
     FT_STATUS fts;
     double endTime = getPreciseTime() + timeout;
-    DWORD received = 0;
+    size_t received = 0;
     int receivedTotal = 0, bytesToTake = FT_STEP;
-    double sleepTime = SLEEPTIME_WIN;
 
     while (getPreciseTime() < endTime) {
-        bytesToTake = inQueue();
+        bytesToTake = waitInput(endTime - getPreciseTime());
         if (bytesToTake < 0){
             return bytesToTake;
         }
-
-        if (bytesToTake == 0){
-            if (mFlowControl && !mIsSerialPort){
-                FT_SetDtr((FT_HANDLE)mHandle);
-                FT_ClrRts((FT_HANDLE)mHandle);
-            }
-            received = 0;
-            if (sleepTime*2 < timeout/2.0)
-                sleepTime *= 2;
-        #ifndef WIN32
-            //usleep(SLEEPTIME_UNIX);
-        #endif
+        if (bytesToTake == 0)
             continue;
-        }
 
-        if ((fts = FT_Read((FT_HANDLE)mHandle, buffer + receivedTotal, static_cast<DWORD>(std::min((size_t)bytesToTake, (toReceive - receivedTotal))), &received))){
+        if ((fts = readQueued(buffer + receivedTotal, std::min((size_t)bytesToTake, (toReceive - receivedTotal)), &received))){
             mLastError = FT_ERR_MSG[fts];
             if (!mLogFile.empty())
                 logBuff(buffer, receivedTotal, true);
@@ -557,15 +736,10 @@ int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double tim
 
         if (received > 0 && !fixedTimeout)
             endTime = getPreciseTime() + timeout;
-
-        #ifdef WIN32
-            if (sleepTime > 16)
-                sleepThreadF(sleepTime/1000);
-        #else
-            //usleep(SLEEPTIME_UNIX);
-        #endif
     }
 
+    receivedTotal = keepWholeItems(buffer, receivedTotal, itemSize);
+
     // terminate buff with \0 if space
     if ((unsigned)receivedTotal < buffSize)
         buffer[receivedTotal] = 0;
@@ -587,11 +761,14 @@ int FtdiDev::receiveAll(char* buffer, size_t size, unsigned maxAttemps, double t
     (void)timeout;
     FT_STATUS fts;
     char* pbuff = buffer;
-    DWORD received = 0;
+    size_t received = 0;
     size_t receivedTotal = 0, attemps = 0;
     while (attemps < maxAttemps){
         attemps++;
-        size_t toReceive = inQueue();
+        int bytes = waitInput(0);
+        if (bytes < 0)
+            return bytes;
+        size_t toReceive = (size_t)bytes;
         if (toReceive == 0){
             //sleepThreadF(0.001);
             if (mFlowControl && !mIsSerialPort){
@@ -601,7 +778,7 @@ int FtdiDev::receiveAll(char* buffer, size_t size, unsigned maxAttemps, double t
             continue;
         }
 
-        if ((fts = FT_Read((FT_HANDLE)mHandle, pbuff, static_cast<DWORD>(std::min(toReceive, size-receivedTotal)),  &received)) != FT_OK){
+        if ((fts = readQueued(pbuff, std::min(toReceive, size-receivedTotal),  &received)) != FT_OK){
             mLastError = FT_ERR_MSG[fts];
             if (!mLogFile.empty())
                 logBuff(buffer, receivedTotal, true);
@@ -623,166 +800,38 @@ int FtdiDev::receiveAll(char* buffer, size_t size, unsigned maxAttemps, double t
     return static_cast<int>(receivedTotal);
 }
 
-int FtdiDev::receiveAllUntilPattern(char* buffer, size_t size, char* pattern, size_t patSize, double timeout)
+int FtdiDev::rename(const char* name)
 {
-    FT_STATUS fts;
-    DWORD received = 0;
-    size_t toReceive = 0;
-    char* pbuff = buffer;
-    size_t receivedTotal = 0;
-
-    double endTime = getPreciseTime() + timeout;
-    while (getPreciseTime() < endTime){
-        toReceive = inQueue();
-        if (toReceive == 0){
-            if (mFlowControl && !mIsSerialPort){
-                FT_SetDtr((FT_HANDLE)mHandle);
-                FT_ClrRts((FT_HANDLE)mHandle);
-            }
-            continue;
-        }
-        if ((fts = FT_Read((FT_HANDLE)mHandle, pbuff, static_cast<DWORD>(std::min(toReceive, size-receivedTotal)),  &received)) != FT_OK){
-            mLastError = FT_ERR_MSG[fts];
-            if (!mLogFile.empty())
-                logBuff(buffer, receivedTotal, true);
-            return -(int)fts;
-        }
-
-        if (mFlowControl && !mIsSerialPort){
-            FT_SetDtr((FT_HANDLE)mHandle);
-            FT_ClrRts((FT_HANDLE)mHandle);
-        }
-
-        pbuff += received;
-        receivedTotal += received;
-        if (findPattern(buffer, receivedTotal, pattern, patSize))
-            break;
-    }
-
-    if (mOnDataFunc)
-        mOnDataFunc(buffer, static_cast<unsigned>(receivedTotal), false, mOnDataUserData);
-    if (!mLogFile.empty())
-        logBuff(buffer, receivedTotal, true);
-
-    return static_cast<int>(receivedTotal);
+    return FT_EE_UAWrite((FT_HANDLE)mHandle, (UCHAR*)name, static_cast<DWORD>(strlen(name)));
 }
 
-int FtdiDev::skipAllUntilPattern(char* pattern, size_t patSize, double timeout)
+int FtdiDev::readStream(FtdiStreamSink sink, void* userData, int packetsPerTransfer, int numTransfers)
 {
-    FT_STATUS fts;
-    DWORD received = 0;
-    unsigned toReceive = 0;
-    char* buff = new char[4096];
-    unsigned size = 4096;
-    unsigned receivedTotal = 0;
-    unsigned patIndex = 0;
-
-    double endTime = getPreciseTime() + timeout;
-    while (getPreciseTime() < endTime){
-        toReceive = inQueue();
-        if (toReceive == 0){
-            if (mFlowControl && !mIsSerialPort){
-                FT_SetDtr((FT_HANDLE)mHandle);
-                FT_ClrRts((FT_HANDLE)mHandle);
-            }
-            continue;
-        }
-
-        if ((fts = FT_Read((FT_HANDLE)mHandle, buff, std::min(toReceive, size),  &received)) != FT_OK){
-            mLastError = FT_ERR_MSG[fts];
-            delete[] buff;
-            return -(int)fts;
-        }
-
-        if (mFlowControl && !mIsSerialPort){
-            FT_SetDtr((FT_HANDLE)mHandle);
-            FT_ClrRts((FT_HANDLE)mHandle);
-        }
-        receivedTotal += received;
-
-        unsigned idx = 0;
-        while (idx < received){
-            if (buff[idx] == pattern[patIndex]){
-                if (patIndex == patSize-1){
-                    delete[] buff;
-                    return receivedTotal;
-                }
-                patIndex++;
-            }else{
-                if (patIndex > 0){
-                    patIndex = 0;
-                    continue;
-                }
-                patIndex = 0;
-            }
-            idx++;
-        }
-
-    }
-    delete[] buff;
-    mLastError = "Timeout";
-    return receivedTotal == 0 ? -1 : -static_cast<int>(receivedTotal);
+    (void)sink; (void)userData; (void)packetsPerTransfer; (void)numTransfers;
+    mLastError = "Not supported in FTD2XX";
+    return -1;
 }
 
-int FtdiDev::getLine(std::string &line, char separ, double timeout)
+void FtdiDev::stopStream()
 {
-    FT_STATUS fts;
-    DWORD received = 0;
-    unsigned toReceive = 0;
-    char buff[1024];
-
-    // if there is line left in mExtraData, return it
-    size_t pos = mExtraData.find(separ);
-    if (pos != std::string::npos){
-        line = pos > 0 ?  mExtraData.substr(0, pos) : "";
-        mExtraData = mExtraData.substr(pos+1);
-        return 0;
-    }
-
-    line = mExtraData;
-    mExtraData.clear();
-    double endTime = getPreciseTime() + timeout;
-    while (getPreciseTime() < endTime){
-        toReceive = inQueue();
-        if (toReceive == 0){
-            if (mFlowControl && !mIsSerialPort){
-                FT_SetDtr((FT_HANDLE)mHandle);
-                FT_ClrRts((FT_HANDLE)mHandle);
-            }
-            continue;
-        }
-
-        if ((fts = FT_Read((FT_HANDLE)mHandle, buff, toReceive<1023?toReceive:1023,  &received)) != FT_OK){
-            mLastError = FT_ERR_MSG[fts];
-            return -(int)fts;
-        }
-        buff[received] = '\0';
-
-        if (mFlowControl && !mIsSerialPort){
-            FT_SetDtr((FT_HANDLE)mHandle);
-            FT_ClrRts((FT_HANDLE)mHandle);
-        }
-
-        for (unsigned i = 0; i < received; i++){
-            if (buff[i] == separ){
-                buff[i] = '\0';
-                line += mExtraData + std::string(buff); // copy line to line
-                if (i < received-1)
-                    mExtraData = std::string(buff+i+1); // copy rest of the data to extra data
-                return 0;
-            }
-        }
-
-        // no new line found, copy everythin to line, and get new data
-        line += std::string(buff);
-    }
-    return -1;
 }
 
+FtdiStreamStats FtdiDev::streamStats()
+{
+    return FtdiStreamStats();
+}
 
-int FtdiDev::rename(const char* name)
+// The driver queues its own USB requests, only the transfer size is used.
+int FtdiDev::setReadPipeline(unsigned depth, unsigned transferSize)
 {
-    return FT_EE_UAWrite((FT_HANDLE)mHandle, (UCHAR*)name, static_cast<DWORD>(strlen(name)));
+    mReadDepth = depth;
+    mReadTransferSize = transferSize;
+    if (!mHandle)
+        return 0;
+    FT_STATUS fts = FT_SetUSBParameters((FT_HANDLE)mHandle, depth > 0 ? transferSize : 0x10000, 0x10000);
+    if (fts != FT_OK)
+        mLastError = FT_ERR_MSG[fts];
+    return -(int)fts;
 }
 
 std::string FtdiDev::readName()
@@ -856,16 +905,38 @@ FtdiDev::FtdiDev(std::string nameOrSerial, bool isSerial)
     , mFlowControl(false)
     , mLastError("")
     , mExtraData("")
+    , mExtraPos(0)
+    , mInputTotal(0)
+    , mFrameDropped(0)
     , mOnDataFunc(NULL)
     , mOnDataUserData(NULL)
+    , mReadPipeline(NULL)
+    , mReadDepth(0)
+    , mReadTransferSize(0x10000)
+    , mStreamStop(false)
+    , mReaderRunning(false)
+    , mReaderStop(false)
+    , mReaderDone(false)
+    , mReaderError(0)
+    , mWriterRunning(false)
+    , mWriterStop(false)
+    , mWriterError(0)
+    , mWriterTimeout(2)
+    , mTxQueued(0)
+    , mTxSent(0)
+    , mRxEvent(NULL)
 {
     mHandle = new struct ftdi_context;
     (void)mIsSerial;
     (void)mIsSerialPort;
+    (void)mRxEvent;
 }
 
 FtdiDev::~FtdiDev()
 {
+    stopWriter();
+    stopReader();
+    readPipelineStop();
     delete (struct ftdi_context*)mHandle;
 }
 
@@ -879,6 +950,7 @@ int FtdiDev::listDevicesByName(const char* filters[], size_t size, std::vector<F
     memset(manufacturer, 0, 129);
     memset(serial, 0, 129);
 
+    std::lock_guard<std::mutex> enumLock(mEnumMutex);
     if (ftdi_init(&ftdic) < 0)
         return -1;
 
@@ -886,11 +958,12 @@ int FtdiDev::listDevicesByName(const char* filters[], size_t size, std::vector<F
     addVidPid(0x04036001);
     addVidPid(0x04036014);
     addVidPid(0x04036015);
-    mNameToVidPid.clear();
+    clearNameVidPids();
 
-    for (unsigned vp = 0; vp < mVidPids.size(); vp++) {
-        unsigned vid = (mVidPids[vp] >> 16) & 0xFFFF;
-        unsigned pid = mVidPids[vp] & 0xFFFF;
+    std::vector<unsigned> vps = vidPids();
+    for (unsigned vp = 0; vp < vps.size(); vp++) {
+        unsigned vid = (vps[vp] >> 16) & 0xFFFF;
+        unsigned pid = vps[vp] & 0xFFFF;
 
         if ((rc = ftdi_usb_find_all(&ftdic, &devlist, vid, pid)) < 0) {
             ftdi_deinit(&ftdic);
@@ -904,18 +977,20 @@ int FtdiDev::listDevicesByName(const char* filters[], size_t size, std::vector<F
                 return -3;
             }
 
-            if (ignoreB && strlen(description) > 1 && description[strlen(description) - 1] == 'B')
+            if (ignoreB && strlen(description) > 1 && description[strlen(description) - 1] == 'B') {
+                curdev = curdev->next;
                 continue;
+            }
 
             if (size == 0){
-                devices.push_back(FtdiDevInfo(std::string(description), getSerial ? std::string(serial): "", mVidPids[vp]));
-                mNameToVidPid[std::string(description)] = mVidPids[vp];
+                devices.push_back(FtdiDevInfo(std::string(description), getSerial ? std::string(serial): "", vps[vp]));
+                setNameVidPid(description, vps[vp]);
             }
 
             for (unsigned j = 0; j < size; j++) {
                 if (strncmp(description, filters[j], strlen(filters[j])) == 0) {
-                    devices.push_back(FtdiDevInfo(std::string(description), getSerial ? std::string(serial) : "", mVidPids[vp]));
-                    mNameToVidPid[std::string(description)] = mVidPids[vp];
+                    devices.push_back(FtdiDevInfo(std::string(description), getSerial ? std::string(serial) : "", vps[vp]));
+                    setNameVidPid(description, vps[vp]);
                     break;
                 }
             }
@@ -943,10 +1018,11 @@ int FtdiDev::listDevicesByVidpid(unsigned long vidpids[], size_t size, std::vect
     memset(manufacturer, 0, 129);
     memset(serial, 0, 129);
 
+    std::lock_guard<std::mutex> enumLock(mEnumMutex);
     if (ftdi_init(&ftdic) < 0)
         return -1;
 
-    mNameToVidPid.clear();
+    clearNameVidPids();
     for (unsigned i = 0; i < size; i++) {
         unsigned vid = (vidpids[i] >> 16) & 0xFFFF;
         unsigned pid = vidpids[i] & 0xFFFF;
@@ -966,10 +1042,12 @@ int FtdiDev::listDevicesByVidpid(unsigned long vidpids[], size_t size, std::vect
                 ftdi_deinit(&ftdic);
                 return -3;
             }
-            if (ignoreB && strlen(description) > 1 && description[strlen(description) - 1] == 'B') 
+            if (ignoreB && strlen(description) > 1 && description[strlen(description) - 1] == 'B') {
+                curdev = curdev->next;
                 continue;
+            }
             devices.push_back(FtdiDevInfo(std::string(description), std::string(serial), (unsigned)vidpids[i]));
-            mNameToVidPid[std::string(description)] = (unsigned)vidpids[i];
+            setNameVidPid(description, (unsigned)vidpids[i]);
             curdev = curdev->next;
         }
 
@@ -983,6 +1061,7 @@ int FtdiDev::listDevicesByVidpid(unsigned long vidpids[], size_t size, std::vect
 int FtdiDev::openDevice(bool flowControl, unsigned vidpid, unsigned intf)
 {
     mFlowControl = flowControl;
+    clearInput();
     if (ftdi_init((FT_HANDLE*)mHandle) < 0) {
         mLastError = "Cannot initialize ftdi.";
         return -1;
@@ -997,10 +1076,13 @@ int FtdiDev::openDevice(bool flowControl, unsigned vidpid, unsigned intf)
         vid = (vidpid >> 16) & 0xFFFF;
         pid = vidpid & 0xFFFF;
     }
-    if (mNameToVidPid.find(mNameOrSerial) != mNameToVidPid.end()){
-        unsigned vidPid = mNameToVidPid[mNameOrSerial];
-        vid = (vidPid >> 16) & 0xFFFF;
-        pid = vidPid & 0xFFFF;
+    unsigned vidPid = 0;
+    {
+        std::lock_guard<std::mutex> enumLock(mEnumMutex);
+        if (findNameVidPid(mNameOrSerial, vidPid)){
+            vid = (vidPid >> 16) & 0xFFFF;
+            pid = vidPid & 0xFFFF;
+        }
     }
 
     int rc = ftdi_usb_open_desc((FT_HANDLE*)mHandle, vid, pid, mNameOrSerial.c_str(), NULL);
@@ -1028,6 +1110,9 @@ int FtdiDev::closeDevice()
 {
     if (((FT_HANDLE*)mHandle)->usb_dev == 0)
         return 0;
+    stopWriter();
+    stopReader();
+    readPipelineStop();
     int rc = ftdi_usb_close((FT_HANDLE*)mHandle);
     ftdi_deinit((FT_HANDLE*)mHandle);
     ((FT_HANDLE*)mHandle)->usb_dev = 0;
@@ -1046,6 +1131,10 @@ bool FtdiDev::isConnected()
 #define SYNC_MODE  0x40
 int FtdiDev::setBitMode(FtdiBitMode mode)
 {
+    flush(mWriterTimeout);
+    bool reader = readerPause();
+    mRing.clear();
+    readPipelineStop();
     ftdi_usb_reset((FT_HANDLE*)mHandle);
     ftdi_usb_purge_buffers((FT_HANDLE*)mHandle);
 
@@ -1058,17 +1147,21 @@ int FtdiDev::setBitMode(FtdiBitMode mode)
     ftdi_read_data_set_chunksize((FT_HANDLE*)mHandle, 0x10000);
     ftdi_write_data_set_chunksize((FT_HANDLE*)mHandle, 0x10000);
     ftdi_set_latency_timer((FT_HANDLE*)mHandle, 2);
+    if (reader)
+        readerResume();
     return 0;
 }
 
 int FtdiDev::setBitMode(unsigned char mode1, unsigned char mode2)
 {
+    flush(mWriterTimeout);
     ftdi_set_bitmode((FT_HANDLE*)mHandle, mode1, mode2);
     return 0;
 }
 
 int FtdiDev::setBaudRate(int baudrate)
 {
+    flush(mWriterTimeout);
     //ftdi_set_bitmode((FT_HANDLE*)mHandle, 1, BITMODE_RESET);
     ftdi_set_line_property((FT_HANDLE*)mHandle, BITS_8, STOP_BIT_1, NONE);
     ftdi_set_baudrate((FT_HANDLE*)mHandle, baudrate);
@@ -1077,6 +1170,7 @@ int FtdiDev::setBaudRate(int baudrate)
 
 int FtdiDev::setLatencyTimer(unsigned time)
 {
+    flush(mWriterTimeout);
     ftdi_set_latency_timer((FT_HANDLE*)mHandle, time);
     return 0;
 }
@@ -1089,16 +1183,27 @@ int FtdiDev::cyclePort()
 
 int FtdiDev::inQueue()
 {
+    if (extraSize() > 0)
+        return static_cast<int>(extraSize());
+    if (mReaderRunning || !mRing.empty())
+        return static_cast<int>(mRing.available());
     mLastError = "Not supported in libFTDI";
     return -1;
 }
 
 int FtdiDev::clearBuffers()
 {
-    return ftdi_usb_purge_buffers((FT_HANDLE*)mHandle);
+    flush(mWriterTimeout);
+    bool reader = readerPause();
+    clearInput();
+    readPipelineStop();
+    int rc = ftdi_usb_purge_buffers((FT_HANDLE*)mHandle);
+    if (reader)
+        readerResume();
+    return rc;
 }
 
-int FtdiDev::send(char* buffer, size_t size, double timeout)
+int FtdiDev::writeData(char* buffer, size_t size, double timeout, std::string& error)
 {
     int bytesSent;
     char* buff = buffer;
@@ -1106,18 +1211,15 @@ int FtdiDev::send(char* buffer, size_t size, double timeout)
     size_t bytesToSend = size;
     double startTime = getPreciseTime();
 
-    if (!mLogFile.empty())
-        logBuff(buffer, size, false);
-
     do {
         bytesSent = ftdi_write_data((FT_HANDLE*)mHandle, (unsigned char*)buff, (int)bytesToSend);
         if (bytesSent < 0) {
-            mLastError = ftdi_get_error_string((FT_HANDLE*)mHandle);
+            error = ftdi_get_error_string((FT_HANDLE*)mHandle);
             return bytesSent;
         }
 
         if ((unsigned)bytesSent > bytesToSend){
-            mLastError = "Device disconnected";
+            error = "Device disconnected";
             return -1;
         }
 
@@ -1125,7 +1227,7 @@ int FtdiDev::send(char* buffer, size_t size, double timeout)
         bytesToSend -= (unsigned)bytesSent;
         buff += bytesSent;
         if (getPreciseTime() - startTime > timeout && bytesSent == 0) {
-            mLastError = "Timeout";
+            error = "Timeout";
             return -1;
         }
 
@@ -1133,13 +1235,10 @@ int FtdiDev::send(char* buffer, size_t size, double timeout)
             startTime = getPreciseTime();
 
     } while (bytesToSend);
-
-    if (mOnDataFunc)
-        mOnDataFunc(buffer, sent, true, mOnDataUserData);
     return sent;
 }
 
-int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double timeout, bool fixedTimeout)
+int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double timeout, bool fixedTimeout, size_t itemSize)
 {
     if (toReceive > buffSize)
         toReceive = buffSize;
@@ -1155,9 +1254,8 @@ int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double tim
 
     while (getPreciseTime() < endTime) {
 
-        received = ftdi_read_data((FT_HANDLE*)mHandle, (unsigned char*)(buffer + receivedTotal),  (int)(toReceive - receivedTotal));
+        received = readInput(buffer + receivedTotal, toReceive - receivedTotal, endTime - getPreciseTime());
         if (received < 0){
-            mLastError = ftdi_get_error_string((FT_HANDLE*)mHandle);
             if (!mLogFile.empty())
                 logBuff(buffer, receivedTotal, true);
             return received;
@@ -1169,15 +1267,10 @@ int FtdiDev::receive(char* buffer, size_t buffSize, size_t toReceive, double tim
 
         if (received > 0)
             endTime = getPreciseTime() + timeout;
-
-        #ifdef WIN32
-            if (sleepTime > 16)
-                sleepThreadF(sleepTime/1000);
-        #else
-            //usleep(SLEEPTIME_UNIX);
-        #endif
     }
 
+    receivedTotal = keepWholeItems(buffer, receivedTotal, itemSize);
+
     // terminate buff with \0 if space
     if ((unsigned)receivedTotal < buffSize && !fixedTimeout)
         buffer[receivedTotal] = 0;
@@ -1201,11 +1294,9 @@ int FtdiDev::receiveAll(char* buffer, size_t size, unsigned maxAttemps, double t
     double startTime = getPreciseTime();
     while (attemps < maxAttemps){
         attemps++;
-        received = ftdi_read_data((FT_HANDLE*)mHandle, (unsigned char*)pbuff, std::min((int)65536, (int)(size - receivedTotal)));
-        if (received < 0){
-            mLastError = ftdi_get_error_string((FT_HANDLE*)mHandle);
+        received = readInput(pbuff, std::min((size_t)65536, size - receivedTotal), timeout > 0 ? startTime + timeout - getPreciseTime() : 0.01);
+        if (received < 0)
             return received;
-        }
 
         pbuff += received;
         receivedTotal += received;
@@ -1222,163 +1313,1232 @@ int FtdiDev::receiveAll(char* buffer, size_t size, unsigned maxAttemps, double t
     return receivedTotal;
 }
 
-int FtdiDev::receiveAllUntilPattern(char* buffer, size_t size, char* pattern, size_t patSize, double timeout)
+int FtdiDev::addVidPid(unsigned vid, unsigned pid)
 {
-    int received = 0;
-    char* pbuff = buffer;
-    size_t receivedTotal = 0;
-    double endTime = getPreciseTime() + timeout;
-
-    while (getPreciseTime() < endTime){
-        received = ftdi_read_data((FT_HANDLE*)mHandle, (unsigned char*)pbuff, (int)(size - receivedTotal));
-        if (received < 0){
-            mLastError = ftdi_get_error_string((FT_HANDLE*)mHandle);
-            if (!mLogFile.empty())
-                logBuff(buffer, receivedTotal, true);
-            return received;
-        }
+    addVidPid(((vid << 16) & 0xFFFF0000) | (pid & 0xFFFF));
+    return 0;
+}
 
-        pbuff += received;
-        receivedTotal += received;
-        if (findPattern(buffer, receivedTotal, pattern, patSize))
-            break;
+int FtdiDev::addVidPid(unsigned vidpid)
+{
+    std::lock_guard<std::mutex> lock(mTablesMutex);
+    for (size_t i = 0; i < mVidPids.size(); i++){
+        if (mVidPids[i] == vidpid)
+            return 0;
     }
+    mVidPids.push_back(vidpid);
+    return 0;
+}
 
-    if (mOnDataFunc)
-        mOnDataFunc(buffer, static_cast<unsigned>(receivedTotal), false, mOnDataUserData);
-
-    if (!mLogFile.empty())
-        logBuff(buffer, receivedTotal, true);
-    return static_cast<int>(receivedTotal);
+int FtdiDev::rename(const char* name)
+{
+    (void)name;
+    //return FT_EE_UAWrite((FT_HANDLE)mHandle, (UCHAR*)name, strlen(name));
+    mLastError = "Not supported in libFTDI";
+    return -1;
 }
 
-int FtdiDev::skipAllUntilPattern(char* pattern, size_t patSize, double timeout)
+void FtdiDev::logBuff(char* buffer, size_t size, bool rx)
 {
-    int received = 0;
-    char* buff = new char[4096];
-    unsigned size = 4096;
-    unsigned receivedTotal = 0;
-    unsigned patIndex = 0;
+    FILE* f = fopen(mLogFile.c_str(), "a");
+    fprintf(f, rx ? "<" : ">");
+    for (size_t i = 0; i < size; i++)
+        fprintf(f, "%02X ", (unsigned char)buffer[i]);
+    fprintf(f, "\n");
+    fclose(f);
+}
 
-    double endTime = getPreciseTime() + timeout;
-    while (getPreciseTime() < endTime){
+std::string FtdiDev::readName()
+{
+    mLastError = "Not supported in libFTDI";
+    return "";
+}
 
-        received = ftdi_read_data((FT_HANDLE*)mHandle, (unsigned char*)buff, size);
-        if (received < 0){
-            mLastError = ftdi_get_error_string((FT_HANDLE*)mHandle);
-            delete[] buff;
-            return received;
+//------------------------------------------------------------------------------------------------------------------------
+// Synchronous FIFO streaming
+//------------------------------------------------------------------------------------------------------------------------
+struct FtdiStreamState
+{
+    FtdiStreamSink sink;
+    void* userData;
+    std::mutex* mutex;
+    FtdiStreamStats* stats;
+    bool* stop;
+};
+
+// data packets (progress is NULL) and once a second progress (buffer is NULL)
+static int streamCallback(uint8_t* buffer, int length, FTDIProgressInfo* progress, void* userdata)
+{
+    FtdiStreamState* state = (FtdiStreamState*)userdata;
+    int rc = 0;
+    if (buffer && length > 0)
+        rc = state->sink((char*)buffer, (size_t)length, state->userData);
+
+    std::lock_guard<std::mutex> lock(*state->mutex);
+    if (buffer && length > 0)
+        state->stats->totalBytes += (unsigned long long)length;
+    if (progress) {
+        state->stats->totalTime = progress->totalTime;
+        state->stats->totalRate = progress->totalRate;
+        state->stats->currentRate = progress->currentRate;
+    }
+    return rc != 0 || *state->stop;
+}
+
+// Switches to 245 synchronous FIFO mode and passes received data to sink until
+// stopStream() is called or sink returns nonzero. Blocks the calling thread.
+int FtdiDev::readStream(FtdiStreamSink sink, void* userData, int packetsPerTransfer, int numTransfers)
+{
+    flush(mWriterTimeout);
+    FT_HANDLE* ftdi = (FT_HANDLE*)mHandle;
+    if (ftdi->usb_dev == 0 || (ftdi->type != TYPE_2232H && ftdi->type != TYPE_232H)) {
+        mLastError = ftdi->usb_dev == 0 ? "Device not opened" : "Synchronous FIFO mode not supported by the chip";
+        return -1;
+    }
+    bool reader = readerPause();
+    readPipelineStop();
+    {
+        std::lock_guard<std::mutex> lock(mStreamMutex);
+        mStreamStats = FtdiStreamStats();
+        mStreamStats.running = true;
+    }
+
+    FtdiStreamState state = {sink, userData, &mStreamMutex, &mStreamStats, &mStreamStop};
+    int rc = ftdi_readstream(ftdi, streamCallback, &state, packetsPerTransfer, numTransfers);
+    if (rc < 0)
+        mLastError = ftdi_get_error_string(ftdi);
+
+    {
+        std::lock_guard<std::mutex> lock(mStreamMutex);
+        mStreamStats.running = false;
+        mStreamStop = false;
+    }
+    if (reader)
+        readerResume();
+    return rc;
+}
+
+// can be called from any thread (also before readStream starts), the stream ends
+// with the next packet or progress report
+void FtdiDev::stopStream()
+{
+    std::lock_guard<std::mutex> lock(mStreamMutex);
+    mStreamStop = true;
+}
+
+FtdiStreamStats FtdiDev::streamStats()
+{
+    std::lock_guard<std::mutex> lock(mStreamMutex);
+    return mStreamStats;
+}
+
+//------------------------------------------------------------------------------------------------------------------------
+// Read pipeline - several bulk IN transfers in flight
+//------------------------------------------------------------------------------------------------------------------------
+// ftdi_read_data_submit uses the shared ftdi readbuffer, so the transfers are submitted
+// with libusb directly. libusb.h is not bundled, the declarations below follow the
+// stable libusb-1.0 ABI.
+extern "C" {
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer* transfer);
+struct libusb_transfer {
+    struct libusb_device_handle* dev_handle;
+    uint8_t flags;
+    unsigned char endpoint;
+    unsigned char type;
+    unsigned int timeout;
+    int status;
+    int length;
+    int actual_length;
+    libusb_transfer_cb_fn callback;
+    void* user_data;
+    unsigned char* buffer;
+    int num_iso_packets;
+};
+struct libusb_transfer* libusb_alloc_transfer(int iso_packets);
+void libusb_free_transfer(struct libusb_transfer* transfer);
+int libusb_submit_transfer(struct libusb_transfer* transfer);
+int libusb_cancel_transfer(struct libusb_transfer* transfer);
+int libusb_handle_events_timeout_completed(struct libusb_context* ctx, struct timeval* tv, int* completed);
+}
+#define LIBUSB_TRANSFER_TYPE_BULK   2
+#define LIBUSB_TRANSFER_COMPLETED   0
+#define LIBUSB_TRANSFER_CANCELLED   3
+#define LIBUSB_TRANSFER_NO_DEVICE   5
+#define FTDI_STATUS_BYTES           2     // modem status at the start of every packet
+
+struct FtdiReadTransfer
+{
+    enum State {IDLE, PENDING, DONE};
+    FtdiReadTransfer() : transfer(NULL), pipeline(NULL), state(IDLE), size(0), offset(0), packetSize(0), status(0) {}
+    struct libusb_transfer* transfer;
+    FtdiReadPipeline* pipeline;
+    std::atomic<int> state;     // set by the callback, it may run in another thread handling libusb events
+    int size;           // data without status bytes
+    int offset;         // already consumed data
+    unsigned packetSize;
+    int status;
+};
+
+struct FtdiReadPipeline
+{
+    FtdiReadPipeline(size_t count) : transfers(count), head(0), stopping(false) {}
+    std::vector<FtdiReadTransfer> transfers;
+    size_t head;        // oldest transfer, data are consumed in order of submission
+    std::atomic<bool> stopping;     // transfers are cancelled, they must not be resubmitted
+};
+
+static void readPipelineCallback(struct libusb_transfer* transfer)
+{
+    FtdiReadTransfer* t = (FtdiReadTransfer*)transfer->user_data;
+    t->status = transfer->status;
+    t->offset = 0;
+    t->size = 0;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        t->state.store(FtdiReadTransfer::DONE, std::memory_order_release);
+        return;
+    }
+
+    // strips status bytes of each packet
+    unsigned char* buff = transfer->buffer;
+    for (int pos = 0; pos < transfer->actual_length; pos += t->packetSize) {
+        int len = std::min((int)t->packetSize, transfer->actual_length - pos) - FTDI_STATUS_BYTES;
+        if (len > 0) {
+            memmove(buff + t->size, buff + pos + FTDI_STATUS_BYTES, len);
+            t->size += len;
         }
+    }
 
-        receivedTotal += received;
-        int idx = 0;
-        while (idx < received){
-            if (buff[idx] == pattern[patIndex]){
-                if (patIndex == patSize-1){
-                    delete[] buff;
-                    return receivedTotal;
-                }
-                patIndex++;
-            }else{
-                if (patIndex > 0){
-                    patIndex = 0;
-                    continue;
-                }
-                patIndex = 0;
+    // status only (idle device, sent every latency period) - resubmitted right away,
+    // the waiting reader is not woken up
+    if (t->size == 0 && !t->pipeline->stopping.load() && libusb_submit_transfer(transfer) == 0)
+        return;
+    t->state.store(FtdiReadTransfer::DONE, std::memory_order_release);
+}
+
+int FtdiDev::setReadPipeline(unsigned depth, unsigned transferSize)
+{
+    readPipelineStop();
+    mReadDepth = depth;
+    mReadTransferSize = transferSize;
+    return 0;
+}
+
+int FtdiDev::readPipelineStart(std::string& error)
+{
+    FT_HANDLE* ftdi = (FT_HANDLE*)mHandle;
+    unsigned packetSize = ftdi->max_packet_size > FTDI_STATUS_BYTES ? ftdi->max_packet_size : 64;
+    int transferSize = (int)std::max(packetSize, mReadTransferSize / packetSize * packetSize);
+
+    mReadPipeline = new FtdiReadPipeline(std::max(mReadDepth, 1u));
+    for (size_t i = 0; i < mReadPipeline->transfers.size(); i++) {
+        FtdiReadTransfer& t = mReadPipeline->transfers[i];
+        t.pipeline = mReadPipeline;
+        t.packetSize = packetSize;
+        t.status = LIBUSB_TRANSFER_COMPLETED;
+        t.transfer = libusb_alloc_transfer(0);
+        if (!t.transfer) {
+            readPipelineStop();
+            error = "Cannot allocate USB transfer";
+            return -1;
+        }
+        t.transfer->dev_handle = ftdi->usb_dev;
+        t.transfer->flags = 0;
+        t.transfer->endpoint = (unsigned char)ftdi->out_ep;    // libftdi reads from out_ep
+        t.transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+        t.transfer->timeout = 0;
+        t.transfer->length = transferSize;
+        t.transfer->callback = readPipelineCallback;
+        t.transfer->user_data = &t;
+        t.transfer->buffer = new unsigned char[transferSize];
+        t.transfer->num_iso_packets = 0;
+    }
+    return 0;
+}
+
+// cancels transfers in flight, their data are dropped
+void FtdiDev::readPipelineStop()
+{
+    if (!mReadPipeline)
+        return;
+
+    FT_HANDLE* ftdi = (FT_HANDLE*)mHandle;
+    std::vector<FtdiReadTransfer>& transfers = mReadPipeline->transfers;
+    bool pending = false;
+    mReadPipeline->stopping.store(true);
+    for (size_t i = 0; i < transfers.size(); i++) {
+        if (transfers[i].state.load(std::memory_order_acquire) == FtdiReadTransfer::PENDING) {
+            libusb_cancel_transfer(transfers[i].transfer);
+            pending = true;
+        }
+    }
+
+    double endTime = getPreciseTime() + 1;
+    while (pending && getPreciseTime() < endTime) {
+        timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(ftdi->usb_ctx, &tv, NULL);
+        pending = false;
+        for (size_t i = 0; i < transfers.size(); i++)
+            pending |= transfers[i].state.load(std::memory_order_acquire) == FtdiReadTransfer::PENDING;
+    }
+
+    // transfer still owned by libusb (should not happen) is leaked rather than freed,
+    // together with the pipeline its late callback writes to
+    bool leaked = false;
+    for (size_t i = 0; i < transfers.size(); i++) {
+        if (!transfers[i].transfer)
+            continue;
+        if (transfers[i].state.load(std::memory_order_acquire) == FtdiReadTransfer::PENDING) {
+            leaked = true;
+            continue;
+        }
+        delete[] transfers[i].transfer->buffer;
+        libusb_free_transfer(transfers[i].transfer);
+    }
+    if (!leaked)
+        delete mReadPipeline;
+    mReadPipeline = NULL;
+}
+
+// Reads available data, waits at most wait seconds for them. The data of completed
+// transfers are returned in order and the transfers are resubmitted, the wait blocks
+// in libusb event handling until a transfer brings data or the deadline passes.
+int FtdiDev::readData(char* buffer, size_t size, double wait, std::string& error)
+{
+    FT_HANDLE* ftdi = (FT_HANDLE*)mHandle;
+    if (ftdi->usb_dev == 0) {
+        int rc = ftdi_read_data(ftdi, (unsigned char*)buffer, (int)size);
+        if (rc < 0)
+            error = ftdi_get_error_string(ftdi);
+        return rc;
+    }
+
+    // data left by ftdi_read_data before the pipeline was enabled
+    if (ftdi->readbuffer_remaining > 0) {
+        unsigned len = std::min((unsigned)size, ftdi->readbuffer_remaining);
+        memcpy(buffer, ftdi->readbuffer + ftdi->readbuffer_offset, len);
+        ftdi->readbuffer_offset += len;
+        ftdi->readbuffer_remaining -= len;
+        return (int)len;
+    }
+
+    if (!mReadPipeline && readPipelineStart(error) < 0)
+        return -1;
+
+    std::vector<FtdiReadTransfer>& transfers = mReadPipeline->transfers;
+    size_t received = 0;
+    bool polled = false;
+    double endTime = getPreciseTime() + wait;
+    while (true) {
+        // submits idle transfers, oldest first
+        for (size_t i = 0; i < transfers.size(); i++) {
+            FtdiReadTransfer& t = transfers[(mReadPipeline->head + i) % transfers.size()];
+            if (t.state.load(std::memory_order_acquire) != FtdiReadTransfer::IDLE)
+                continue;
+            // pending before the submission, the callback may complete it in another thread
+            t.state.store(FtdiReadTransfer::PENDING, std::memory_order_relaxed);
+            int rc = libusb_submit_transfer(t.transfer);
+            if (rc < 0) {
+                t.state.store(FtdiReadTransfer::IDLE, std::memory_order_relaxed);
+                error = "Cannot submit USB transfer";
+                return received > 0 ? (int)received : rc;
+            }
+        }
+
+        // takes data of completed transfers in order
+        while (received < size) {
+            FtdiReadTransfer& t = transfers[mReadPipeline->head];
+            if (t.state.load(std::memory_order_acquire) != FtdiReadTransfer::DONE)
+                break;
+            if (t.status != LIBUSB_TRANSFER_COMPLETED && t.status != LIBUSB_TRANSFER_CANCELLED) {
+                t.state.store(FtdiReadTransfer::IDLE, std::memory_order_relaxed);
+                error = t.status == LIBUSB_TRANSFER_NO_DEVICE ? "Device disconnected" : "USB transfer failed";
+                return received > 0 ? (int)received : -1;
+            }
+            int len = std::min(t.size - t.offset, (int)(size - received));
+            memcpy(buffer + received, t.transfer->buffer + t.offset, len);
+            t.offset += len;
+            received += len;
+            if (t.offset == t.size) {
+                t.state.store(FtdiReadTransfer::IDLE, std::memory_order_relaxed);
+                mReadPipeline->head = (mReadPipeline->head + 1) % transfers.size();
             }
-            idx++;
         }
 
+        // events are handled at least once, also with zero wait
+        double remaining = endTime - getPreciseTime();
+        if (received > 0 || (remaining <= 0 && polled))
+            break;
+        if (remaining < 0)
+            remaining = 0;
+
+        timeval tv;
+        tv.tv_sec = (long)remaining;
+        tv.tv_usec = (long)((remaining - tv.tv_sec) * 1e6);
+        libusb_handle_events_timeout_completed(ftdi->usb_ctx, &tv, NULL);
+        polled = true;
     }
-    delete[] buff;
-    mLastError = "Timeout";
-    return receivedTotal == 0 ? -1 : -static_cast<int>(receivedTotal);
+    return static_cast<int>(received);
 }
 
-int FtdiDev::getLine(std::string &line, char separ, double timeout)
+#endif
+
+
+
+
+//########################################################################################################################
+//                                              COMMON
+//########################################################################################################################
+
+std::vector<unsigned> FtdiDev::vidPids()
 {
-    int received = 0;
-    char buff[1024];
+    std::lock_guard<std::mutex> lock(mTablesMutex);
+    return mVidPids;
+}
 
-    // if there is line left in mExtraData, return it
-    size_t pos = mExtraData.find(separ);
-    if (pos != std::string::npos){
-        line = pos > 0 ?  mExtraData.substr(0, pos) : "";
-        mExtraData = mExtraData.substr(pos+1);
-        return 0;
+bool FtdiDev::findNameVidPid(const std::string& name, unsigned& vidpid)
+{
+    std::lock_guard<std::mutex> lock(mTablesMutex);
+    std::map<std::string, unsigned>::const_iterator it = mNameToVidPid.find(name);
+    if (it == mNameToVidPid.end())
+        return false;
+    vidpid = it->second;
+    return true;
+}
+
+void FtdiDev::setNameVidPid(const std::string& name, unsigned vidpid)
+{
+    std::lock_guard<std::mutex> lock(mTablesMutex);
+    mNameToVidPid[name] = vidpid;
+}
+
+void FtdiDev::clearNameVidPids()
+{
+    std::lock_guard<std::mutex> lock(mTablesMutex);
+    mNameToVidPid.clear();
+}
+
+// Sends requests and receives their responses of expected sizes. Responses are stored
+// one after another to rxBuffer, rxOffsets (count + 1 items) gets start of each response
+// and total received size at the end. With pipelineWindow > 0 requests are sent in
+// batches (one write) as long as the responses in flight fit into the window.
+// Returns total received size, it is smaller than expected on timeout.
+int FtdiDev::transact(FtdiTransaction* items, size_t count, char* rxBuffer, size_t rxBuffSize, size_t* rxOffsets, double timeout, size_t pipelineWindow)
+{
+    size_t expected = 0;
+    for (size_t i = 0; i < count; i++)
+        expected += items[i].rxSize;
+    if (expected > rxBuffSize) {
+        mLastError = "Buffer too small";
+        return -1;
     }
 
-    line = mExtraData;
-    mExtraData.clear();
+    std::vector<FtdiIoVec> txParts;
+    size_t sent = 0, rxPos = 0;
+    while (sent < count) {
+        // requests of one batch are sent as one gathered write
+        size_t txSize = 0, rxSize = 0, last = sent;
+        txParts.clear();
+        while (last < count && (last == sent || (pipelineWindow > 0 && rxSize + items[last].rxSize <= pipelineWindow))) {
+            txParts.push_back(FtdiIoVec(items[last].txData, items[last].txSize));
+            txSize += items[last].txSize;
+            rxSize += items[last].rxSize;
+            last++;
+        }
+        sent = last;
+
+        if (txSize > 0) {
+            int rc = send(txParts.data(), txParts.size(), timeout);
+            if (rc < 0)
+                return rc;
+        }
+
+        if (rxSize > 0) {
+            int rc = receive(rxBuffer + rxPos, rxBuffSize - rxPos, rxSize, timeout);
+            if (rc < 0)
+                return rc;
+            rxPos += (size_t)rc;
+            if ((size_t)rc < rxSize)
+                break;
+        }
+    }
+
+    // responses after timeout are empty
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        rxOffsets[i] = std::min(offset, rxPos);
+        offset += items[i].rxSize;
+    }
+    rxOffsets[count] = rxPos;
+    return static_cast<int>(rxPos);
+}
+
+#define EXCHANGE_WINDOW  0x4000  // default limit of written bytes whose samples were not read yet
+
+// Full-duplex transfer for the synchronous bit bang mode, where every written byte
+// returns one sample to rx. Data are written in chunks keeping at most window bytes
+// unanswered and the samples are read in between, so the chip FIFO cannot overflow
+// also for large sizes. window should not exceed data the reads in flight can take
+// (read pipeline depth * transfer size). Returns number of received samples.
+int FtdiDev::exchange(const char* tx, char* rx, size_t size, double timeout, size_t window)
+{
+    if (window == 0)
+        window = EXCHANGE_WINDOW;
+
+    // reads are started before the first write
+    int rc = readInput(rx, 0, 0);
+    if (rc < 0)
+        return rc;
+
+    size_t sent = 0, received = 0;
     double endTime = getPreciseTime() + timeout;
-    while (getPreciseTime() < endTime){
+    while (received < size) {
+        // written in larger chunks, not a few bytes after each read
+        size_t space = window - (sent - received);
+        size_t chunk = std::min(size - sent, space);
+        bool write = chunk > 0 && (chunk == size - sent || space >= window / 2);
+        if (write) {
+            rc = send(const_cast<char*>(tx + sent), chunk, timeout);
+            if (rc < 0)
+                return rc;
+            sent += chunk;
+        }
+
+        rc = readInput(rx + received, sent - received, write ? 0 : endTime - getPreciseTime());
+        if (rc < 0)
+            return rc;
+        received += (size_t)rc;
+        if (rc > 0 || write)
+            endTime = getPreciseTime() + timeout;
+        else if (getPreciseTime() >= endTime) {
+            mLastError = "Timeout";
+            break;
+        }
+    }
+
+    if (mOnDataFunc)
+        mOnDataFunc(rx, static_cast<unsigned>(received), false, mOnDataUserData);
+    if (!mLogFile.empty())
+        logBuff(rx, received, true);
+    return static_cast<int>(received);
+}
 
-        received = ftdi_read_data((FT_HANDLE*)mHandle, (unsigned char*)buff, 1023);
+#define READER_WAIT      0.01  // longest wait of the reader thread for data, in s
+
+// Starts a thread that continuously reads the device into a ring of ringSize bytes.
+// receive, getLine and the pattern functions are then served from the ring and
+// inQueue reports its fill. The reader waits while the ring is full.
+int FtdiDev::startReader(size_t ringSize)
+{
+    stopReader();
+    if (!isConnected()) {
+        mLastError = "Device not opened";
+        return -1;
+    }
+    if (mRing.capacity() < ringSize && mRing.empty())   // data left from previous run are kept
+        mRing.reinit(ringSize);
+    readerResume();
+    return 0;
+}
+
+// data left in the ring are still returned by the next reads
+void FtdiDev::stopReader()
+{
+    readerPause();
+}
+
+// stops the reader thread, returns true if it was running
+bool FtdiDev::readerPause()
+{
+    if (!mReaderRunning)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(mReaderMutex);
+        mReaderStop = true;
+        mReaderCond.notify_all();
+    }
+    mReaderThread.join();
+    mReaderRunning = false;
+    return true;
+}
+
+void FtdiDev::readerResume()
+{
+    mReaderStop = false;
+    mReaderDone = false;
+    mReaderError = 0;
+    mReaderRunning = true;
+    mReaderThread = std::thread(&FtdiDev::readerRun, this);
+}
+
+void FtdiDev::readerRun()
+{
+    int rc = 0;
+    std::string error;      // mLastError belongs to the caller thread
+    while (true) {
+        char* ptr;
+        size_t space = mRing.writeSpan(&ptr);
+        {
+            std::unique_lock<std::mutex> lock(mReaderMutex);
+            if (space == 0)
+                mReaderCond.wait(lock, [this]{ return mReaderStop || mRing.space() > 0; });
+            if (mReaderStop)
+                break;
+        }
+        if (space == 0)
+            continue;
+
+        rc = readData(ptr, space, READER_WAIT, error);
+        if (rc < 0)
+            break;
+        if (rc > 0) {
+            mRing.produce((size_t)rc);
+            std::lock_guard<std::mutex> lock(mReaderMutex);
+            mReaderCond.notify_all();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mReaderMutex);
+    mReaderError = rc < 0 ? rc : 0;
+    mReaderMessage = error;
+    mReaderDone = true;
+    mReaderCond.notify_all();
+}
+
+// reads from the ring, waits at most wait seconds for data
+int FtdiDev::readRing(char* buffer, size_t size, double wait)
+{
+    bool full = mRing.space() == 0;
+    size_t received = mRing.read(buffer, size);
+    bool done = false;
+    int error = 0;
+    if (received == 0 && mReaderRunning) {
+        std::unique_lock<std::mutex> lock(mReaderMutex);
+        if (wait > 0)
+            mReaderCond.wait_for(lock, std::chrono::duration<double>(wait), [this]{ return mReaderDone || !mRing.empty(); });
+        done = mReaderDone;
+        error = mReaderError;
+        lock.unlock();
+        full = mRing.space() == 0;
+        received = mRing.read(buffer, size);
+    }
+
+    // reader may wait for space
+    if (full && received > 0) {
+        std::lock_guard<std::mutex> lock(mReaderMutex);
+        mReaderCond.notify_all();
+    }
+    if (received == 0 && done && error < 0) {
+        mLastError = mReaderMessage;    // set before done, it does not change after the reader finished
+        return error;
+    }
+    return static_cast<int>(received);
+}
+
+// Receives data to buffer until the pattern is received (found anywhere in the data,
+// also when split over several reads). Data after the pattern stay for the next read.
+// Returns received size including the pattern, the whole received data on timeout
+// or full buffer.
+int FtdiDev::receiveAllUntilPattern(char* buffer, size_t size, char* pattern, size_t patSize, double timeout)
+{
+    PatternMatcher matcher(pattern, patSize);
+    size_t receivedTotal = 0;
+    double endTime = getPreciseTime() + timeout;
+
+    while (receivedTotal < size && getPreciseTime() < endTime){
+        int received = readInput(buffer + receivedTotal, size - receivedTotal, endTime - getPreciseTime());
         if (received < 0){
-            mLastError = ftdi_get_error_string((FT_HANDLE*)mHandle);
+            if (!mLogFile.empty())
+                logBuff(buffer, receivedTotal, true);
             return received;
         }
-        buff[received] = '\0';
-
-        for (int i = 0; i < received; i++){
-            if (buff[i] == separ){
-                buff[i] = '\0';
-                line += mExtraData + std::string(buff); // copy line to line
-                if (i < received-1)
-                    mExtraData = std::string(buff+i+1); // copy rest of the data to extra data
-                return 0;
-            }
+
+        size_t end = matcher.feed(buffer + receivedTotal, (size_t)received);
+        if (end != PatternMatcher::NOT_FOUND) {
+            unreadData(buffer + receivedTotal + end, (size_t)received - end);
+            receivedTotal += end;
+            break;
         }
-        // no new line found, copy everythin to line, and get new data
-        line += std::string(buff);
+        receivedTotal += (size_t)received;
     }
+
+    if (mOnDataFunc)
+        mOnDataFunc(buffer, static_cast<unsigned>(receivedTotal), false, mOnDataUserData);
+    if (!mLogFile.empty())
+        logBuff(buffer, receivedTotal, true);
+    return static_cast<int>(receivedTotal);
+}
+
+// Drops received data until the end of the pattern, data after the pattern stay for
+// the next read. Returns number of dropped bytes (including the pattern), on timeout
+// minus number of dropped bytes (-1 if nothing was received).
+int FtdiDev::skipAllUntilPattern(char* pattern, size_t patSize, double timeout)
+{
+    PatternMatcher matcher(pattern, patSize);
+    char buff[4096];
+    unsigned receivedTotal = 0;
+    double endTime = getPreciseTime() + timeout;
+
+    while (getPreciseTime() < endTime){
+        int received = readInput(buff, sizeof(buff), endTime - getPreciseTime());
+        if (received < 0)
+            return received;
+
+        size_t end = matcher.feed(buff, (size_t)received);
+        if (end != PatternMatcher::NOT_FOUND) {
+            unreadData(buff + end, (size_t)received - end);
+            return receivedTotal + static_cast<unsigned>(end);
+        }
+        receivedTotal += received;
+    }
+    mLastError = "Timeout";
+    return receivedTotal == 0 ? -1 : -static_cast<int>(receivedTotal);
+}
+
+int FtdiDev::readExtra(char* buffer, size_t size)
+{
+    size_t count = std::min(size, extraSize());
+    memcpy(buffer, mExtraData.data() + mExtraPos, count);
+    mExtraPos += count;
+    if (mExtraPos == mExtraData.size()) {
+        mExtraData.clear();
+        mExtraPos = 0;
+    }
+    return static_cast<int>(count);
+}
+
+// Waits for any of the patterns, the input is scanned once for all of them. Data are
+// dropped until the end of the first match, data after it stay for the next read.
+// Returns index of the matched pattern, offset gets number of bytes before the
+// pattern. On timeout returns -1 and offset gets number of dropped bytes.
+int FtdiDev::expect(const FtdiIoVec* patterns, size_t count, size_t* offset, double timeout)
+{
+    MultiPatternMatcher matcher;
+    for (size_t i = 0; i < count; i++)
+        matcher.add(patterns[i].data, patterns[i].size);
+    matcher.build();
+
+    char buff[4096];
+    size_t receivedTotal = 0;
+    *offset = 0;
+    double endTime = getPreciseTime() + timeout;
+    while (getPreciseTime() < endTime){
+        int received = readInput(buff, sizeof(buff), endTime - getPreciseTime());
+        if (received < 0)
+            return received;
+
+        size_t index = 0;
+        size_t end = matcher.feed(buff, (size_t)received, &index);
+        if (end != MultiPatternMatcher::NOT_FOUND) {
+            unreadData(buff + end, (size_t)received - end);
+            *offset = receivedTotal + end - matcher.patternSize(index);
+            return static_cast<int>(index);
+        }
+        receivedTotal += (size_t)received;
+    }
+    *offset = receivedTotal;
+    mLastError = "Timeout";
     return -1;
 }
 
-int FtdiDev::addVidPid(unsigned vid, unsigned pid)
+// returns incomplete trailing item of received data to the input (before it is reported),
+// returns size of the complete items
+int FtdiDev::keepWholeItems(char* buffer, int size, size_t itemSize)
 {
-    addVidPid(((vid << 16) & 0xFFFF0000) | (pid & 0xFFFF));
+    size_t rest = itemSize > 1 ? (size_t)size % itemSize : 0;
+    unreadData(buffer + size - rest, rest);
+    return size - static_cast<int>(rest);
+}
+
+// drops received data not read yet (reader ring and returned data), the reader thread
+// must not be running
+void FtdiDev::clearInput()
+{
+    mRing.clear();
+    mExtraData.clear();
+    mExtraPos = 0;
+    mInputTimes.clear();
+}
+
+// returns data read from the input back to it, they are read again before newer data
+void FtdiDev::unreadData(const char* data, size_t size)
+{
+    if (size == 0)
+        return;
+    if (size <= mExtraPos) {
+        mExtraPos -= size;
+        memcpy(&mExtraData[mExtraPos], data, size);
+        return;
+    }
+    mExtraData.replace(0, mExtraPos, data, size);
+    mExtraPos = 0;
+}
+
+#define LINE_READ_SIZE   0x4000    // data appended to the input per read when lines are searched
+#define LINES_MAX_INPUT  0x100000  // readLines and readFrames take already received data up to this size
+#define FRAME_LENGTH_MAX 0x100000  // limit of FRAME_LENGTH frames without max size (corrupted length field)
+
+// appends received data to the returned input data, waits at most wait seconds for them
+int FtdiDev::fillInput(double wait)
+{
+    // consumed part is dropped once it is at least half of the buffer
+    if (mExtraPos > 0 && mExtraPos * 2 >= mExtraData.size()) {
+        mExtraData.erase(0, mExtraPos);
+        mExtraPos = 0;
+    }
+    size_t used = mExtraData.size();
+    mExtraData.resize(used + LINE_READ_SIZE);
+    int rc = readDevice(&mExtraData[used], LINE_READ_SIZE, wait);
+    mExtraData.resize(used + (rc > 0 ? (size_t)rc : 0));
+    if (rc > 0 && mFrameFormat.kind != FtdiFrameFormat::FRAME_NONE)
+        mInputTimes.push_back(std::make_pair(mInputTotal, getPreciseTime()));
+    return rc;
+}
+
+// waits at most timeout for a complete line in the input, returns 1 and position of
+// its separator in mExtraData, 0 on timeout
+int FtdiDev::waitSeparator(char separ, double timeout, size_t* pos)
+{
+    size_t scanned = 0;     // beginning of the input without separator
+    double endTime = getPreciseTime() + timeout;
+    while (true) {
+        const char* data = mExtraData.data() + mExtraPos;
+        const char* found = (const char*)memchr(data + scanned, separ, extraSize() - scanned);
+        if (found) {
+            *pos = found - mExtraData.data();
+            return 1;
+        }
+        scanned = extraSize();
+
+        double wait = endTime - getPreciseTime();
+        if (wait <= 0) {
+            mLastError = "Timeout";
+            return 0;
+        }
+        int rc = fillInput(wait);
+        if (rc < 0)
+            return rc;
+    }
+}
+
+// Reads one line (without the separator). On timeout the incomplete line is returned
+// with -1.
+int FtdiDev::getLine(std::string &line, char separ, double timeout)
+{
+    size_t pos = 0;
+    int rc = waitSeparator(separ, timeout, &pos);
+    if (rc < 0) {
+        line.clear();
+        return rc;
+    }
+    if (rc == 0) {
+        line.assign(mExtraData, mExtraPos, std::string::npos);
+        mExtraData.clear();
+        mExtraPos = 0;
+        return -1;
+    }
+    line.assign(mExtraData, mExtraPos, pos - mExtraPos);
+    mExtraPos = pos + 1;
     return 0;
 }
 
-int FtdiDev::addVidPid(unsigned vidpid)
+// Complete lines of the input, views of them (without separators) stay valid until
+// the next read. Waits at most timeout for the first line, then takes also the lines
+// of data already received. maxLines = 0 takes all lines. Returns number of lines.
+int FtdiDev::readLines(std::vector<FtdiIoVec>& lines, size_t maxLines, char separ, double timeout)
 {
-    for (size_t i = 0; i < mVidPids.size(); i++){
-        if (mVidPids[i] == vidpid)
+    lines.clear();
+    size_t pos = 0;
+    int rc = waitSeparator(separ, timeout, &pos);
+    if (rc <= 0)
+        return rc;
+    while (extraSize() < LINES_MAX_INPUT && fillInput(0) > 0)
+        ;
+
+    const char* data = mExtraData.data();
+    size_t size = mExtraData.size();
+    while (maxLines == 0 || lines.size() < maxLines) {
+        const char* found = (const char*)memchr(data + mExtraPos, separ, size - mExtraPos);
+        if (!found)
+            break;
+        lines.push_back(FtdiIoVec(data + mExtraPos, found - data - mExtraPos));
+        mExtraPos = found - data + 1;
+    }
+    return static_cast<int>(lines.size());
+}
+
+int FtdiDev::setFraming(const FtdiFrameFormat& format)
+{
+    if (!format.isValid()) {
+        mLastError = "Invalid frame format";
+        return -1;
+    }
+    mFrameFormat = format;
+    mFrameDropped = 0;
+    mInputTimes.clear();
+    return 0;
+}
+
+void FtdiDev::dropInput(size_t size)
+{
+    mExtraPos += size;
+    mFrameDropped += size;
+}
+
+// Looks for a frame at the beginning of the input, data that cannot start a frame are
+// dropped. Returns 1 when the frame is complete: size of the frame and end of its data
+// in the input (including the delimiter), 0 when more data are needed. scanned keeps
+// the part of the input searched for the delimiter between the calls.
+int FtdiDev::findFrame(size_t* size, size_t* end, size_t* scanned)
+{
+    const FtdiFrameFormat& format = mFrameFormat;
+    while (true) {
+        size_t avail = extraSize();
+        if (!format.sync.empty()) {
+            size_t found = mExtraData.find(format.sync, mExtraPos);
+            if (found != mExtraPos) {
+                // keeps possible beginning of the sync at the end of the input
+                size_t keep = found == std::string::npos ? std::min(avail, format.sync.size() - 1) : mExtraData.size() - found;
+                dropInput(avail - keep);
+                *scanned = 0;
+                if (found == std::string::npos)
+                    return 0;
+                continue;
+            }
+        }
+        const unsigned char* data = (const unsigned char*)mExtraData.data() + mExtraPos;
+
+        switch (format.kind) {
+            case FtdiFrameFormat::FRAME_FIXED:
+                if (avail < format.size)
+                    return 0;
+                *size = *end = format.size;
+                return 1;
+
+            case FtdiFrameFormat::FRAME_LENGTH: {
+                size_t header = std::max(format.lengthOffset + format.lengthWidth, format.sync.size());
+                if (avail < header)
+                    return 0;
+                unsigned long long length = 0;
+                for (size_t i = 0; i < format.lengthWidth; i++)
+                    length |= (unsigned long long)data[format.lengthOffset + (format.bigEndian ? format.lengthWidth - 1 - i : i)] << (8 * i);
+                long long frameSize = (long long)length + format.lengthAdjust;
+                size_t maxSize = format.maxSize > 0 ? format.maxSize : FRAME_LENGTH_MAX;
+                if (frameSize < (long long)header || (unsigned long long)frameSize > maxSize) {
+                    dropInput(1);   // not a frame, searched again from the next byte
+                    continue;
+                }
+                if (avail < (size_t)frameSize)
+                    return 0;
+                *size = *end = (size_t)frameSize;
+                return 1;
+            }
+
+            case FtdiFrameFormat::FRAME_DELIMITER: {
+                size_t delimSize = format.delimiter.size();
+                size_t from = std::max(*scanned, format.sync.size());
+                size_t found = from < avail ? mExtraData.find(format.delimiter, mExtraPos + from) : std::string::npos;
+                if (found == std::string::npos) {
+                    *scanned = avail > delimSize ? avail - delimSize + 1 : 0;
+                    return 0;
+                }
+                *scanned = 0;
+                size_t frameSize = found - mExtraPos;
+                if (format.maxSize > 0 && frameSize > format.maxSize) {
+                    dropInput(frameSize + delimSize);
+                    continue;
+                }
+                *size = frameSize;
+                *end = frameSize + delimSize;
+                return 1;
+            }
+
+            default:
+                return 0;
+        }
+    }
+}
+
+// Complete frames of the input (see setFraming), views of them stay valid until the
+// next read. Waits at most timeout for the first frame, then takes also the frames of
+// data already received. maxFrames = 0 takes all frames. Returns number of frames.
+int FtdiDev::readFrames(std::vector<FtdiFrame>& frames, size_t maxFrames, double timeout)
+{
+    frames.clear();
+    if (mFrameFormat.kind == FtdiFrameFormat::FRAME_NONE) {
+        mLastError = "Framing not set";
+        return -1;
+    }
+
+    // times of consumed data are not needed anymore
+    unsigned long long consumed = mInputTotal - extraSize();
+    size_t old = 0;
+    while (old < mInputTimes.size() && mInputTimes[old].first <= consumed)
+        old++;
+    mInputTimes.erase(mInputTimes.begin(), mInputTimes.begin() + old);
+
+    size_t size = 0;
+    size_t end = 0;
+    size_t scanned = 0;
+    double endTime = getPreciseTime() + timeout;
+    while (!findFrame(&size, &end, &scanned)) {
+        double wait = endTime - getPreciseTime();
+        if (wait <= 0) {
+            mLastError = "Timeout";
             return 0;
+        }
+        int rc = fillInput(wait);
+        if (rc < 0)
+            return rc;
     }
-    mVidPids.push_back(vidpid);
+    while (extraSize() < LINES_MAX_INPUT && fillInput(0) > 0)
+        ;
+
+    // frame gets the time of the read that completed it
+    unsigned long long base = mInputTotal - mExtraData.size();     // stream position of mExtraData[0]
+    size_t mark = 0;
+    do {
+        unsigned long long frameEnd = base + mExtraPos + size;
+        while (mark < mInputTimes.size() && mInputTimes[mark].first < frameEnd)
+            mark++;
+        double time = mark < mInputTimes.size() ? mInputTimes[mark].second : getPreciseTime();
+        frames.push_back(FtdiFrame(mExtraData.data() + mExtraPos, size, time));
+        mExtraPos += end;
+    } while ((maxFrames == 0 || frames.size() < maxFrames) && findFrame(&size, &end, &scanned));
+    return static_cast<int>(frames.size());
+}
+
+// waits at most wait seconds for data in the ring
+void FtdiDev::readerWait(double wait)
+{
+    std::unique_lock<std::mutex> lock(mReaderMutex);
+    mReaderCond.wait_for(lock, std::chrono::duration<double>(wait), [this]{ return mReaderDone || !mRing.empty(); });
+}
+
+// input data - returned data first, then from the device
+int FtdiDev::readInput(char* buffer, size_t size, double wait)
+{
+    if (extraSize() > 0)
+        return readExtra(buffer, size);
+    return readDevice(buffer, size, wait);
+}
+
+// device data - from the ring while the reader thread runs (or has data left)
+int FtdiDev::readDevice(char* buffer, size_t size, double wait)
+{
+    int rc = mReaderRunning || !mRing.empty() ? readRing(buffer, size, wait) : readData(buffer, size, wait, mLastError);
+    if (rc > 0)
+        mInputTotal += (size_t)rc;
+    return rc;
+}
+
+// Sends data, with the writer thread running the data are only queued (the call waits
+// while the queue is full) and the writes overlap with the caller's work.
+int FtdiDev::send(char* buffer, size_t size, double timeout)
+{
+    if (mWriterRunning)
+        return queueData(buffer, size, timeout);
+    return writeOutput(buffer, size, timeout);
+}
+
+#define SEND_GATHER_SIZE 0x10000  // small parts of a scatter-gather send are joined into writes of this size
+
+// Sends parts as one continuous stream. Small parts are packed together into writes of
+// up to SEND_GATHER_SIZE bytes, large parts are written directly without copying.
+// Returns total size sent.
+int FtdiDev::send(const FtdiIoVec* parts, size_t count, double timeout)
+{
+    if (count == 1 && parts[0].size > 0)
+        return send(const_cast<char*>(parts[0].data), parts[0].size, timeout);
+
+    size_t total = 0;
+    if (mWriterRunning) {
+        for (size_t i = 0; i < count; i++) {
+            int rc = queueData(const_cast<char*>(parts[i].data), parts[i].size, timeout);
+            if (rc < 0)
+                return rc;
+            total += parts[i].size;
+        }
+        return static_cast<int>(total);
+    }
+
+    size_t gatherSize = 0;
+    for (size_t i = 0; i < count && gatherSize < SEND_GATHER_SIZE; i++)
+        gatherSize += parts[i].size;
+    Buffer<char> gather(std::min(gatherSize, (size_t)SEND_GATHER_SIZE));
+    size_t used = 0;
+    for (size_t i = 0; i <= count; i++) {
+        bool last = i == count;
+        bool direct = !last && parts[i].size >= SEND_GATHER_SIZE / 2;
+        if (used > 0 && (last || direct || used + parts[i].size > SEND_GATHER_SIZE)) {
+            int rc = writeOutput(gather.data(), used, timeout);
+            if (rc < 0)
+                return rc;
+            total += used;
+            used = 0;
+        }
+        if (last || parts[i].size == 0)
+            continue;
+
+        if (direct) {
+            int rc = writeOutput(const_cast<char*>(parts[i].data), parts[i].size, timeout);
+            if (rc < 0)
+                return rc;
+            total += parts[i].size;
+        } else {
+            memcpy(gather.data() + used, parts[i].data, parts[i].size);
+            used += parts[i].size;
+        }
+    }
+    return static_cast<int>(total);
+}
+
+// Starts a thread that writes the data queued by send (queue of queueSize bytes),
+// timeout is used for the writes of the thread. Completion of the queued data is
+// checked with flush or waitSent. Control functions (bit mode, baud rate, clearing
+// buffers...) flush the queue first, so the order of operations is kept.
+int FtdiDev::startWriter(size_t queueSize, double timeout)
+{
+    int rc = stopWriter();
+    if (rc < 0)
+        return rc;
+    if (!isConnected()) {
+        mLastError = "Device not opened";
+        return -1;
+    }
+    if (mTxRing.capacity() < queueSize)
+        mTxRing.reinit(queueSize);
+    mWriterStop = false;
+    mWriterError = 0;
+    mWriterMessage.clear();
+    mWriterTimeout = timeout;
+    mWriterRunning = true;
+    mWriterThread = std::thread(&FtdiDev::writerRun, this);
     return 0;
 }
 
-int FtdiDev::rename(const char* name)
+// writes the queued data and stops the thread, returns error of the writes
+int FtdiDev::stopWriter()
 {
-    (void)name;
-    //return FT_EE_UAWrite((FT_HANDLE)mHandle, (UCHAR*)name, strlen(name));
-    mLastError = "Not supported in libFTDI";
-    return -1;
+    if (!mWriterRunning)
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(mWriterMutex);
+        mWriterStop = true;
+        mWriterCond.notify_all();
+    }
+    mWriterThread.join();
+    mWriterRunning = false;
+    if (mWriterError < 0)
+        mLastError = mWriterMessage;
+    return mWriterError;
 }
 
-void FtdiDev::logBuff(char* buffer, size_t size, bool rx)
+// waits until all data queued so far are written
+int FtdiDev::flush(double timeout)
 {
-    FILE* f = fopen(mLogFile.c_str(), "a");
-    fprintf(f, rx ? "<" : ">");
-    for (size_t i = 0; i < size; i++)
-        fprintf(f, "%02X ", (unsigned char)buffer[i]);
-    fprintf(f, "\n");
-    fclose(f);
+    if (!mWriterRunning)
+        return 0;
+    return waitSent(txToken(), timeout);
 }
 
-std::string FtdiDev::readName()
+// waits until the data up to token (txToken() after their send) are written
+int FtdiDev::waitSent(unsigned long long token, double timeout)
 {
-    mLastError = "Not supported in libFTDI";
-    return "";
+    std::unique_lock<std::mutex> lock(mWriterMutex);
+    bool sent = mWriterCond.wait_for(lock, std::chrono::duration<double>(timeout),
+                                     [this, token]{ return mTxSent >= token || mWriterError < 0 || !mWriterRunning; });
+    if (mWriterError < 0) {
+        mLastError = mWriterMessage;
+        return mWriterError;
+    }
+    if (!sent || mTxSent < token) {
+        mLastError = "Timeout";
+        return -1;
+    }
+    return 0;
 }
 
-#endif
+unsigned long long FtdiDev::txToken()
+{
+    std::lock_guard<std::mutex> lock(mWriterMutex);
+    return mTxQueued;
+}
 
+// writes on the caller thread, the data are logged and passed to the on-data function
+int FtdiDev::writeOutput(char* buffer, size_t size, double timeout)
+{
+    if (!mLogFile.empty())
+        logBuff(buffer, size, false);
+    int rc = writeData(buffer, size, timeout, mLastError);
+    if (rc >= 0 && mOnDataFunc)
+        mOnDataFunc(buffer, static_cast<unsigned>(rc), true, mOnDataUserData);
+    return rc;
+}
 
+// Queues data for the writer thread. The data are logged and passed to the on-data
+// function here when queued, the writer thread does not use them (they may be changed
+// by the caller while it writes).
+int FtdiDev::queueData(char* buffer, size_t size, double timeout)
+{
+    int rc = static_cast<int>(size);
+    size_t queued = 0;
+    {
+        std::unique_lock<std::mutex> lock(mWriterMutex);
+        while (queued < size) {
+            if (mWriterError < 0) {
+                mLastError = mWriterMessage;
+                rc = mWriterError;
+                break;
+            }
+            size_t count = mTxRing.write(buffer + queued, size - queued);
+            if (count > 0) {
+                queued += count;
+                mTxQueued += count;
+                mWriterCond.notify_all();
+            } else if (!mWriterCond.wait_for(lock, std::chrono::duration<double>(timeout),
+                                             [this]{ return mWriterError < 0 || mTxRing.space() > 0; })) {
+                mLastError = "Timeout";
+                rc = -1;
+                break;
+            }
+        }
+    }
+
+    if (queued > 0 && !mLogFile.empty())
+        logBuff(buffer, queued, false);
+    if (queued > 0 && mOnDataFunc)
+        mOnDataFunc(buffer, static_cast<unsigned>(queued), true, mOnDataUserData);
+    return rc;
+}
 
+void FtdiDev::writerRun()
+{
+    std::string error;      // mLastError belongs to the caller thread
+    std::unique_lock<std::mutex> lock(mWriterMutex);
+    while (true) {
+        mWriterCond.wait(lock, [this]{ return mWriterStop || !mTxRing.empty(); });
+        if (mTxRing.empty())
+            break;
+
+        // queued data are not overwritten until consumed, they are written without the lock
+        const char* data;
+        size_t count = mTxRing.readSpan(&data);
+        lock.unlock();
+        int rc = writeData(const_cast<char*>(data), count, mWriterTimeout, error);
+        lock.lock();
+        if (rc < 0) {
+            mWriterError = rc;
+            mWriterMessage = error;
+            mTxRing.consume(mTxRing.available());   // rest of the queue is dropped
+            mWriterCond.notify_all();
+            break;
+        }
+        mTxRing.consume(count);
+        mTxSent += count;
+        mWriterCond.notify_all();
+    }
+}
 
 //########################################################################################################################
 //                                              UTILITIES
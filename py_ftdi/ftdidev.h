@@ -9,10 +9,17 @@
 #ifndef FTDIDEV_H
 #define FTDIDEV_H
 #include <string>
+#include <cstring>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "ringbuffer.h"
 typedef void (*FtdiOnDataType)(char* data, unsigned size, bool tx, void* userpar);
+typedef int (*FtdiStreamSink)(char* data, size_t size, void* userpar);    // nonzero return stops the stream
 typedef void* FtdiHandle;
+struct FtdiReadPipeline;
 
 struct FtdiDevInfo
 {
@@ -23,6 +30,66 @@ struct FtdiDevInfo
     unsigned vidpid;
 };
 
+struct FtdiStreamStats
+{
+    FtdiStreamStats() : totalBytes(0), totalTime(0), totalRate(0), currentRate(0), running(false) {}
+    unsigned long long totalBytes;
+    double totalTime;       // s
+    double totalRate;       // average rate, B/s
+    double currentRate;     // B/s
+    bool running;
+};
+
+struct FtdiIoVec
+{
+    FtdiIoVec(const char* _data = NULL, size_t _size = 0) : data(_data), size(_size) {}
+    const char* data;
+    size_t size;
+};
+
+// Frames cut from the input stream: fixed size, size given by a length field in the
+// frame header, or terminated by a delimiter
+struct FtdiFrameFormat
+{
+    enum Kind {FRAME_NONE, FRAME_FIXED, FRAME_LENGTH, FRAME_DELIMITER};
+    FtdiFrameFormat() : kind(FRAME_NONE), size(0), lengthOffset(0), lengthWidth(1), bigEndian(false), lengthAdjust(0), maxSize(0) {}
+    bool isValid() const {
+        switch (kind) {
+            case FRAME_NONE:        return true;
+            case FRAME_FIXED:       return size > 0 && size >= sync.size();
+            case FRAME_LENGTH:      return lengthWidth == 1 || lengthWidth == 2 || lengthWidth == 4 || lengthWidth == 8;
+            case FRAME_DELIMITER:   return !delimiter.empty();
+        }
+        return false;
+    }
+    Kind kind;
+    size_t size;            // FRAME_FIXED: frame size
+    size_t lengthOffset;    // FRAME_LENGTH: position of the length field in the frame
+    size_t lengthWidth;     // FRAME_LENGTH: 1, 2, 4 or 8 bytes
+    bool bigEndian;         // FRAME_LENGTH: byte order of the length field
+    long long lengthAdjust; // FRAME_LENGTH: frame size = length field + lengthAdjust
+    std::string delimiter;  // FRAME_DELIMITER: end of the frame, not part of it
+    std::string sync;       // frames start with these bytes, data before them are dropped
+    size_t maxSize;         // longer frames are dropped, 0 = no limit (FRAME_LENGTH: 1 MB)
+};
+
+struct FtdiFrame
+{
+    FtdiFrame(const char* _data = NULL, size_t _size = 0, double _time = 0) : data(_data), size(_size), time(_time) {}
+    const char* data;
+    size_t size;
+    double time;            // when the end of the frame was read from the device (s since epoch)
+};
+
+struct FtdiTransaction
+{
+    FtdiTransaction(char* _txData = NULL, size_t _txSize = 0, size_t _rxSize = 0)
+        : txData(_txData), txSize(_txSize), rxSize(_rxSize) {}
+    char* txData;       // request
+    size_t txSize;
+    size_t rxSize;      // expected size of the response
+};
+
 
 class FtdiDev
 {
@@ -51,13 +118,34 @@ public:
     int cyclePort();
     int inQueue();
     int clearBuffers();
+    int setReadPipeline(unsigned depth, unsigned transferSize = 0x10000);
+    int startReader(size_t ringSize = 1 << 22);
+    void stopReader();
+    bool readerRunning() const { return mReaderRunning; }
+    int startWriter(size_t queueSize = 1 << 20, double timeout = 2);
+    int stopWriter();
+    bool writerRunning() const { return mWriterRunning; }
+    int flush(double timeout = 2);
+    int waitSent(unsigned long long token, double timeout = 2);
+    unsigned long long txToken();
     int send(char* buffer, size_t size, double timeout = 2);
-    int receive(char* buffer, size_t buffSize, size_t toReceive, double timeout = 2, bool fixedTimeout=false);
+    int send(const FtdiIoVec* parts, size_t count, double timeout = 2);
+    int receive(char* buffer, size_t buffSize, size_t toReceive, double timeout = 2, bool fixedTimeout=false, size_t itemSize = 1);
     int receiveAll(char* buffer, size_t size, unsigned maxAttemps, double timeout = -1);
     int receiveAllUntilPattern(char* buffer, size_t size, char* pattern, size_t patSize, double timeout = 2);
     int skipAllUntilPattern(char* pattern, size_t patSize, double timeout = 2);
+    int expect(const FtdiIoVec* patterns, size_t count, size_t* offset, double timeout = 2);
     int getLine(std::string &line, char separ='\n', double timeout = 2);
-    bool lineAvailable(char separ = '\n') { size_t pos = mExtraData.find(separ); return pos != std::string::npos; }
+    int readStream(FtdiStreamSink sink, void* userData, int packetsPerTransfer = 8, int numTransfers = 256);
+    void stopStream();
+    FtdiStreamStats streamStats();
+    int exchange(const char* tx, char* rx, size_t size, double timeout = 2, size_t window = 0);
+    int transact(FtdiTransaction* items, size_t count, char* rxBuffer, size_t rxBuffSize, size_t* rxOffsets, double timeout = 2, size_t pipelineWindow = 0);
+    int readLines(std::vector<FtdiIoVec>& lines, size_t maxLines = 0, char separ = '\n', double timeout = 2);
+    int setFraming(const FtdiFrameFormat& format);
+    int readFrames(std::vector<FtdiFrame>& frames, size_t maxFrames = 0, double timeout = 2);
+    unsigned long long framingDropped() const { return mFrameDropped; }
+    bool lineAvailable(char separ = '\n') { return memchr(mExtraData.data() + mExtraPos, separ, extraSize()) != NULL; }
     int rename(const char* name);
     std::string readName();
     const char* getLastError() { return mLastError.c_str();}
@@ -69,14 +157,36 @@ public:
     void setNameOrSerial(const char* nameOrSerial) { mNameOrSerial = nameOrSerial; }
 
 private:
+    static std::vector<unsigned> vidPids();
+    static bool findNameVidPid(const std::string& name, unsigned& vidpid);
+    static void setNameVidPid(const std::string& name, unsigned vidpid);
+    static void clearNameVidPids();
     void logBuff(char* buffer, size_t size, bool rx);
-    inline bool findPattern(char* buffer, size_t buffSize, char* pattern, size_t patternSize) {
-        if (buffSize < patternSize) return false;
-        for (size_t i = buffSize - patternSize; i < buffSize; i++)
-            if (buffer[i] != pattern[i - buffSize + patternSize])
-                return false;
-        return true;
-    }
+    int readData(char* buffer, size_t size, double wait, std::string& error);
+    int writeData(char* buffer, size_t size, double timeout, std::string& error);
+    int writeOutput(char* buffer, size_t size, double timeout);
+    int queueData(char* buffer, size_t size, double timeout);
+    void writerRun();
+    int readInput(char* buffer, size_t size, double wait);
+    int readDevice(char* buffer, size_t size, double wait);
+    int readExtra(char* buffer, size_t size);
+    void unreadData(const char* data, size_t size);
+    void clearInput();
+    int keepWholeItems(char* buffer, int size, size_t itemSize);
+    size_t extraSize() const { return mExtraData.size() - mExtraPos; }
+    int fillInput(double wait);
+    int waitSeparator(char separ, double timeout, size_t* pos);
+    int findFrame(size_t* size, size_t* end, size_t* scanned);
+    void dropInput(size_t size);
+    int readQueued(char* buffer, size_t size, size_t* received);
+    int readRing(char* buffer, size_t size, double wait);
+    int waitInput(double wait);
+    void readerWait(double wait);
+    void readerRun();
+    bool readerPause();
+    void readerResume();
+    int readPipelineStart(std::string& error);
+    void readPipelineStop();
 
 private:
     FtdiHandle mHandle;
@@ -85,12 +195,46 @@ private:
     bool mFlowControl;
     bool mIsSerialPort;
     std::string mLastError;
-    std::string mExtraData;
+    std::string mExtraData;             // data returned to the input (after a line or pattern), read first
+    size_t mExtraPos;                   // consumed part of mExtraData
+    unsigned long long mInputTotal;     // bytes read from the device, stream position of the end of mExtraData (returned data were counted before)
+    std::vector<std::pair<unsigned long long, double> > mInputTimes;    // framing: stream position of the end of each read and its time
+    FtdiFrameFormat mFrameFormat;
+    unsigned long long mFrameDropped;   // bytes dropped by framing (no sync, invalid or too long frame)
     std::string mLogFile;
     static std::vector<unsigned> mVidPids;
     static std::map<std::string, unsigned> mNameToVidPid;
+    static std::mutex mTablesMutex;     // guards mVidPids and mNameToVidPid
+    static std::mutex mEnumMutex;       // serializes enumeration/open (FT_SetVIDPID is global in FTD2XX)
     FtdiOnDataType mOnDataFunc;
     void* mOnDataUserData;
+    FtdiReadPipeline* mReadPipeline;    // libftdi: transfers in flight
+    unsigned mReadDepth;                // number of transfers in flight (libftdi: 0 = one)
+    unsigned mReadTransferSize;
+    std::mutex mStreamMutex;            // guards mStreamStats and mStreamStop, they are used from other threads
+    FtdiStreamStats mStreamStats;
+    bool mStreamStop;
+    RingBuffer<char> mRing;             // data read by the reader thread
+    std::thread mReaderThread;
+    std::mutex mReaderMutex;
+    std::condition_variable mReaderCond;    // data or space in the ring, reader finished
+    bool mReaderRunning;
+    bool mReaderStop;
+    bool mReaderDone;
+    int mReaderError;
+    std::string mReaderMessage;         // error message of the reader thread, guarded by mReaderMutex
+    RingBuffer<char> mTxRing;           // data queued for the writer thread
+    std::thread mWriterThread;
+    std::mutex mWriterMutex;            // guards mTxRing and the writer state below
+    std::condition_variable mWriterCond;    // data queued, data written, writer finished
+    bool mWriterRunning;
+    bool mWriterStop;
+    int mWriterError;
+    std::string mWriterMessage;         // error message of the writer thread, guarded by mWriterMutex
+    double mWriterTimeout;
+    unsigned long long mTxQueued;       // bytes queued since creation, used as completion tokens
+    unsigned long long mTxSent;         // bytes written to the device
+    void* mRxEvent;                     // FTD2XX: event signalled on received data
 };
 
 
@@ -0,0 +1,178 @@
+/**
+ * Copyright (C) 2023 Daniel Turecek
+ *
+ * @file      matcher.h
+ * @author    Daniel Turecek <daniel@turecek.de>
+ * @date      2023-02-05
+ *
+ */
+#ifndef MATCHER_H
+#define MATCHER_H
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Streaming search of one pattern (Knuth-Morris-Pratt). The state is kept between
+// the chunks, so a pattern split over several reads is found as well. Without a
+// partial match the first byte of the pattern is searched by memchr (vectorized
+// in the C library).
+class PatternMatcher
+{
+public:
+    static const size_t NOT_FOUND = (size_t)-1;
+
+public:
+    PatternMatcher(const char* pattern = NULL, size_t size = 0) {
+        reset(pattern, size);
+    }
+
+    void reset(const char* pattern, size_t size) {
+        mPattern.assign(pattern ? pattern : "", pattern ? size : 0);
+        mFail.assign(mPattern.size(), 0);
+        for (size_t i = 1, k = 0; i < mPattern.size(); i++) {
+            while (k > 0 && mPattern[i] != mPattern[k])
+                k = mFail[k - 1];
+            if (mPattern[i] == mPattern[k])
+                k++;
+            mFail[i] = k;
+        }
+        mState = 0;
+    }
+
+    void restart() { mState = 0; }
+    size_t size() const { return mPattern.size(); }
+
+    // searches next chunk of the stream, returns position in data just after the end
+    // of the first match or NOT_FOUND. The search starts again after a match.
+    size_t feed(const char* data, size_t size) {
+        const size_t patSize = mPattern.size();
+        if (patSize == 0)
+            return 0;
+
+        size_t i = 0;
+        while (i < size) {
+            if (mState == 0) {
+                const char* first = (const char*)memchr(data + i, mPattern[0], size - i);
+                if (!first)
+                    return NOT_FOUND;
+                i = first - data + 1;
+                mState = 1;
+            } else {
+                char c = data[i++];
+                while (mState > 0 && c != mPattern[mState])
+                    mState = mFail[mState - 1];
+                if (c == mPattern[mState])
+                    mState++;
+            }
+            if (mState == patSize) {
+                mState = 0;
+                return i;
+            }
+        }
+        return NOT_FOUND;
+    }
+
+private:
+    std::string mPattern;
+    std::vector<size_t> mFail;  // length of the longest proper prefix that is also suffix
+    size_t mState;              // length of the matched prefix
+};
+
+// Streaming search of several patterns at once (Aho-Corasick automaton with a full
+// transition table). Reports the first match to end in the stream, of the patterns
+// ending at the same byte the longest one.
+class MultiPatternMatcher
+{
+public:
+    static const size_t NOT_FOUND = (size_t)-1;
+
+public:
+    MultiPatternMatcher() { clear(); }
+
+    void clear() {
+        mNext.assign(256, -1);
+        mFail.assign(1, 0);
+        mOut.assign(1, -1);
+        mSizes.clear();
+        mState = 0;
+    }
+
+    // patterns are added before build()
+    void add(const char* pattern, size_t size) {
+        int state = 0;
+        for (size_t i = 0; i < size; i++) {
+            int& next = mNext[state * 256 + (unsigned char)pattern[i]];
+            if (next < 0) {
+                next = (int)mFail.size();
+                mNext.resize(mNext.size() + 256, -1);
+                mFail.push_back(0);
+                mOut.push_back(-1);
+            }
+            state = mNext[state * 256 + (unsigned char)pattern[i]];
+        }
+        if (mOut[state] < 0)
+            mOut[state] = (int)mSizes.size();
+        mSizes.push_back(size);
+    }
+
+    // fills the fail links and missing transitions (breadth first)
+    void build() {
+        std::vector<int> queue;
+        for (int c = 0; c < 256; c++) {
+            int& next = mNext[c];
+            if (next < 0)
+                next = 0;
+            else
+                queue.push_back(next);
+        }
+        for (size_t q = 0; q < queue.size(); q++) {
+            int state = queue[q];
+            if (mOut[state] < 0)
+                mOut[state] = mOut[mFail[state]];
+            for (int c = 0; c < 256; c++) {
+                int& next = mNext[state * 256 + c];
+                if (next < 0) {
+                    next = mNext[mFail[state] * 256 + c];
+                } else {
+                    mFail[next] = mNext[mFail[state] * 256 + c];
+                    queue.push_back(next);
+                }
+            }
+        }
+        mState = 0;
+    }
+
+    void restart() { mState = 0; }
+    size_t count() const { return mSizes.size(); }
+    size_t patternSize(size_t index) const { return mSizes[index]; }
+
+    // searches next chunk of the stream, returns position in data just after the end
+    // of the first match (index of the pattern in pattern) or NOT_FOUND
+    size_t feed(const char* data, size_t size, size_t* pattern) {
+        if (mOut[0] >= 0) {    // empty pattern
+            *pattern = (size_t)mOut[0];
+            return 0;
+        }
+        const int* next = mNext.data();
+        int state = mState;
+        for (size_t i = 0; i < size; i++) {
+            state = next[state * 256 + (unsigned char)data[i]];
+            if (mOut[state] >= 0) {
+                *pattern = (size_t)mOut[state];
+                mState = 0;
+                return i + 1;
+            }
+        }
+        mState = state;
+        return NOT_FOUND;
+    }
+
+private:
+    std::vector<int> mNext;     // transitions, 256 for each state
+    std::vector<int> mFail;
+    std::vector<int> mOut;      // pattern ending in the state (also through fail links), -1 = none
+    std::vector<size_t> mSizes;
+    int mState;
+};
+
+#endif /* end of include guard: MATCHER_H */
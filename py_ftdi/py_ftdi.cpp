@@ -8,35 +8,129 @@
  */
 #include "Python.h"
 #include "structmember.h"
+#include "commonpython.h"
 #include "ftdidev.h"
 #include "buffer.h"
+#include "dataconv.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#ifndef WIN32
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <errno.h>
+#endif
+#ifdef __linux__
+    #include <sys/eventfd.h>
+#endif
+
+// Blocking FtdiDev calls run with the GIL released. Each device has its own lock,
+// so calls on one handle are serialized while different devices run in parallel.
+#define DEVICE_BEGIN_IO(self) Py_BEGIN_ALLOW_THREADS PyThread_acquire_lock((self)->lock, WAIT_LOCK);
+#define DEVICE_END_IO(self) PyThread_release_lock((self)->lock); Py_END_ALLOW_THREADS
+#define ERR_NOT_OPENED -1000
+
+struct DeviceWorker;
+struct DataTap;
+struct FifoStream;
 
 typedef struct {
     PyObject_HEAD
     FtdiDev* dev;
+    PyThread_type_lock lock;
+    DeviceWorker* worker;
+    DataTap* tap;       // set_on_data batcher
+    unsigned readDepth;         // read pipeline, applied also to reopened device
+    unsigned readTransferSize;
+    FifoStream* fifo;   // running synchronous FIFO stream
+    size_t readerRingSize;      // background reader, 0 = not used
+    size_t writerQueueSize;     // background writer, 0 = not used
+    double writerTimeout;
+    FtdiFrameFormat* frameFormat;   // set_framing, applied also to reopened device
 } Device;
 
-static int device_init(Device *self, PyObject *args, PyObject *kwds)
+typedef struct {
+    PyObject* deviceType;
+    PyObject* streamType;
+    PyObject* chunkType;
+    PyObject* groupType;
+    PyObject* getRunningLoop;   // asyncio.get_running_loop, imported on first use
+    PyObject* setFutureResult;  // _set_future_result
+    PyObject* asyncLoops;       // set of event loops watching the async notifier
+} ModuleState;
+
+static inline ModuleState* moduleState(PyObject* module)
+{
+    return (ModuleState*)PyModule_GetState(module);
+}
+
+static PyObject* device_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
+    Device* self = (Device*)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+
     self->dev = NULL;
+    self->worker = NULL;
+    self->tap = NULL;
+    self->fifo = NULL;
+    self->readerRingSize = 0;
+    self->writerQueueSize = 0;
+    self->writerTimeout = 2;
+    self->frameFormat = NULL;
+    self->readDepth = 0;
+    self->readTransferSize = 0x10000;
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock){
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    return (PyObject*)self;
+}
+
+static int device_init(Device *self, PyObject *args, PyObject *kwds)
+{
     return 0;
 }
 
+static void deviceWorkerStop(Device* self);
+static void dataTapOnData(char* data, unsigned size, bool tx, void* userData);
+static void dataTapStop(DataTap* tap);
+static int fifoStreamStop(Device* self);
+
 static void device_dealloc(Device *self)
 {
+    PyTypeObject* type = Py_TYPE(self);
+    deviceWorkerStop(self);
+    fifoStreamStop(self);
     if (self->dev){
         delete self->dev;
         self->dev = NULL;
     }
+    dataTapStop(self->tap);
+    self->tap = NULL;
+    delete self->frameFormat;
+    self->frameFormat = NULL;
+    if (self->lock){
+        PyThread_free_lock(self->lock);
+        self->lock = NULL;
+    }
 
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
 }
 
-static PyObject* device_listDevices(PyObject* self, PyObject *args)
+static PyObject* device_listDevices(PyObject* self, PyObject* Py_UNUSED(args))
 {
     (void)self;
     std::vector<FtdiDevInfo> devs;
+    Py_BEGIN_ALLOW_THREADS
     FtdiDev::listDevicesByNameFast(NULL, 0, devs, false);
+    Py_END_ALLOW_THREADS
     PyObject* obj = PyList_New(devs.size());
     for (size_t i = 0; i < devs.size(); i++){
         PyList_SetItem(obj, i, PyUnicode_FromString(devs[i].name.c_str()));
@@ -44,108 +138,348 @@ static PyObject* device_listDevices(PyObject* self, PyObject *args)
     return obj;
 }
 
-static PyObject* device_open(Device* self, PyObject *args)
+static PyObject* device_open(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
 {
-    (void)self;
+    static const char* const kwlist[] = {"dev_name", "baud", "interface_index", NULL};
+    PyObject* values[3];
     const char* devName;
     int baud;
     int interface;
-    if (!PyArg_ParseTuple(args, "sii", &devName, &baud, &interface))
+    if (!pyParseArgs(args, nargs, kwnames, "open", kwlist, 3, values) || !pyArgString(values[0], &devName)
+        || !pyArgInt(values[1], &baud) || !pyArgInt(values[2], &interface))
         return NULL;
 
-    if (self->dev)
+    std::string name(devName);
+    int rc = 0;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev){
         self->dev->closeDevice();
+        delete self->dev;
+    }
 
-    self->dev = new FtdiDev(devName, false);
-    int rc = self->dev->openDevice(false, 0, interface);
+    self->dev = new FtdiDev(name, false);
+    if (self->tap)
+        self->dev->setOnDataFunc(dataTapOnData, self->tap);
+    if (self->readDepth > 0)
+        self->dev->setReadPipeline(self->readDepth, self->readTransferSize);
+    if (self->frameFormat)
+        self->dev->setFraming(*self->frameFormat);
+    rc = self->dev->openDevice(false, 0, interface);
     if (baud != 0)
         self->dev->setBaudRate(baud);
+    if (rc == 0 && self->readerRingSize > 0)
+        self->dev->startReader(self->readerRingSize);
+    if (rc == 0 && self->writerQueueSize > 0)
+        self->dev->startWriter(self->writerQueueSize, self->writerTimeout);
+    DEVICE_END_IO(self)
 
-    return Py_BuildValue("i", rc);
+    return PyLong_FromLong(rc);
 }
 
-static PyObject* device_setSyncMode(Device* self, PyObject *args)
+static PyObject* device_setSyncMode(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
 {
+    static const char* const kwlist[] = {"is_sync_mode", NULL};
+    PyObject* values[1];
     int sync;
-    if (!PyArg_ParseTuple(args, "i", &sync))
+    if (!pyParseArgs(args, nargs, kwnames, "set_sync_mode", kwlist, 1, values) || !pyArgInt(values[0], &sync))
         return NULL;
 
-    if (!self->dev)
-        return Py_BuildValue("i", -1000);
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->setBitMode(sync ? FtdiDev::BIT_SYNC : FtdiDev::BIT_ASYNC);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_setReadPipeline(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"depth", "transfer_size", NULL};
+    PyObject* values[2];
+    int depth;
+    int transferSize = 0x10000;
+    if (!pyParseArgs(args, nargs, kwnames, "set_read_pipeline", kwlist, 1, values) || !pyArgInt(values[0], &depth)
+        || (values[1] && !pyArgInt(values[1], &transferSize)))
+        return NULL;
+    if (depth < 0 || depth > 1024 || transferSize < 512) {
+        PyErr_SetString(PyExc_ValueError, transferSize < 512 ? "Invalid transfer size." : "Invalid depth.");
+        return NULL;
+    }
+
+    int rc = 0;
+    DEVICE_BEGIN_IO(self)
+    self->readDepth = (unsigned)depth;
+    self->readTransferSize = (unsigned)transferSize;
+    if (self->dev)
+        rc = self->dev->setReadPipeline(self->readDepth, self->readTransferSize);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_startReader(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"ring_size", NULL};
+    PyObject* values[1];
+    Py_ssize_t ringSize = 1 << 22;
+    if (!pyParseArgs(args, nargs, kwnames, "start_reader", kwlist, 0, values)
+        || (values[0] && !pyArgSize(values[0], &ringSize)))
+        return NULL;
+    if (ringSize < 4096) {
+        PyErr_SetString(PyExc_ValueError, "Invalid ring size.");
+        return NULL;
+    }
 
-    int rc = self->dev->setBitMode(sync ? FtdiDev::BIT_SYNC : FtdiDev::BIT_ASYNC);
-    return Py_BuildValue("i", rc);
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    self->readerRingSize = (size_t)ringSize;
+    if (self->dev)
+        rc = self->dev->startReader(self->readerRingSize);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
 }
 
-static PyObject* device_isConnected(Device* self, PyObject *args)
+static PyObject* device_stopReader(Device* self, PyObject* Py_UNUSED(args))
 {
-    (void)self;
-    if (!self->dev)
-        return Py_BuildValue("i", 0);
+    DEVICE_BEGIN_IO(self)
+    self->readerRingSize = 0;
+    if (self->dev)
+        self->dev->stopReader();
+    DEVICE_END_IO(self)
+    Py_RETURN_NONE;
+}
 
-    int rc = self->dev->isConnected();
-    return Py_BuildValue("i", rc);
+static PyObject* device_inQueue(Device* self, PyObject* Py_UNUSED(args))
+{
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->inQueue();
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
 }
 
-static PyObject* device_clearBuffers(Device* self, PyObject *args)
+static PyObject* device_startWriter(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
 {
-    (void)self;
-    if (!self->dev)
-        return Py_BuildValue("i", -1000);
+    static const char* const kwlist[] = {"queue_size", "timeout", NULL};
+    PyObject* values[2];
+    Py_ssize_t queueSize = 1 << 20;
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "start_writer", kwlist, 0, values)
+        || (values[0] && !pyArgSize(values[0], &queueSize))
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
+        return NULL;
+    if (queueSize < 4096) {
+        PyErr_SetString(PyExc_ValueError, "Invalid queue size.");
+        return NULL;
+    }
+
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    self->writerQueueSize = (size_t)queueSize;
+    self->writerTimeout = timeout;
+    if (self->dev)
+        rc = self->dev->startWriter(self->writerQueueSize, timeout);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_stopWriter(Device* self, PyObject* Py_UNUSED(args))
+{
+    int rc = 0;
+    DEVICE_BEGIN_IO(self)
+    self->writerQueueSize = 0;
+    if (self->dev)
+        rc = self->dev->stopWriter();
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_flush(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"timeout", NULL};
+    PyObject* values[1];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "flush", kwlist, 0, values)
+        || (values[0] && !pyArgDouble(values[0], &timeout)))
+        return NULL;
+
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->flush(timeout);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_waitSent(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"token", "timeout", NULL};
+    PyObject* values[2];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "wait_sent", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
+        return NULL;
+    unsigned long long token = PyLong_AsUnsignedLongLong(values[0]);
+    if (token == (unsigned long long)-1 && PyErr_Occurred())
+        return NULL;
+
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->waitSent(token, timeout);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_txToken(Device* self, PyObject* Py_UNUSED(args))
+{
+    unsigned long long token = 0;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        token = self->dev->txToken();
+    DEVICE_END_IO(self)
+    return PyLong_FromUnsignedLongLong(token);
+}
+
+static PyObject* device_isConnected(Device* self, PyObject* Py_UNUSED(args))
+{
+    int rc = 0;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->isConnected();
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
 
-    int rc = self->dev->clearBuffers();
-    return Py_BuildValue("i", rc);
+static PyObject* device_clearBuffers(Device* self, PyObject* Py_UNUSED(args))
+{
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->clearBuffers();
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
 }
 
 
-static PyObject* device_close(Device* self, PyObject *args)
+static PyObject* device_close(Device* self, PyObject* Py_UNUSED(args))
 {
-    (void)args;
     int rc = 0;
+    DEVICE_BEGIN_IO(self)
     if (self->dev){
         rc = self->dev->closeDevice();
         delete self->dev;
     }
     self->dev = NULL;
-    return Py_BuildValue("i", rc);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+// exports data to send - buffers directly, lists of ints are converted to bytes first
+static int getDataBuffer(PyObject* data, Py_buffer* view)
+{
+    if (!PyList_Check(data))
+        return PyObject_GetBuffer(data, view, PyBUF_SIMPLE);
+
+    Py_ssize_t count = PyList_GET_SIZE(data);
+    PyObject* bytes = PyBytes_FromStringAndSize(NULL, count);
+    if (!bytes)
+        return -1;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        long value = PyLong_AsLong(PyList_GET_ITEM(data, i));
+        if (value == -1 && PyErr_Occurred()) {
+            Py_DECREF(bytes);
+            return -1;
+        }
+        if (value < 0 || value > 255) {
+            PyErr_SetString(PyExc_ValueError, "List items must be in range 0-255.");
+            Py_DECREF(bytes);
+            return -1;
+        }
+        PyBytes_AS_STRING(bytes)[i] = static_cast<char>(value);
+    }
+
+    int rc = PyObject_GetBuffer(bytes, view, PyBUF_SIMPLE);
+    Py_DECREF(bytes);
+    return rc;
 }
 
-static PyObject* device_send(Device* self, PyObject *args)
+static PyObject* device_send(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
 {
+    static const char* const kwlist[] = {"data", NULL};
     PyObject* data;
-    if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &data))
+    if (!pyParseArgs(args, nargs, kwnames, "send", kwlist, 1, &data))
         return NULL;
 
-    if (!self->dev)
-        return Py_BuildValue("i", -1000);
+    int rc = ERR_NOT_OPENED;
 
-    Py_ssize_t count = PyList_Size(data);
-    if (count < 0){
-        PyErr_SetString(PyExc_IOError, "Invalid data.");
+    // bytes, bytearray, memoryview, array, numpy... - memory is sent directly,
+    // list of ints (kept for compatibility) is converted
+    Py_buffer view;
+    if (getDataBuffer(data, &view) < 0)
         return NULL;
-    }
 
-    Buffer<unsigned char> buff(count);
-    for (int i = 0; i < count; i++)
-        buff[i] = static_cast<unsigned char>(PyLong_AsLong(PyList_GetItem(data, i)));
-
-    int rc = self->dev->send((char*)buff.data(), (size_t)count);
-    return Py_BuildValue("i", rc);
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = view.len > 0 ? self->dev->send((char*)view.buf, (size_t)view.len) : 0;
+    DEVICE_END_IO(self)
+    PyBuffer_Release(&view);
+    return PyLong_FromLong(rc);
 }
 
-static PyObject* device_read(Device* self, PyObject *args)
+// parts are sent as one stream without joining them in Python
+static PyObject* device_sendParts(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
 {
-    (void)self;
-    int size;
-    double timeout;
-    if (!PyArg_ParseTuple(args, "id", &size, &timeout))
+    static const char* const kwlist[] = {"parts", "timeout", NULL};
+    PyObject* values[2];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "send_parts", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
         return NULL;
-    if (!self->dev)
-        return Py_BuildValue("i", -1000);
 
+    PyObject* seq = PySequence_Fast(values[0], "parts must be a sequence of bytes-like objects");
+    if (!seq)
+        return NULL;
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    std::vector<Py_buffer> views;
+    std::vector<FtdiIoVec> parts;
+    views.reserve(count);
+    parts.reserve(count);
+    bool ok = true;
+    for (Py_ssize_t i = 0; i < count && ok; i++) {
+        Py_buffer view;
+        ok = getDataBuffer(PySequence_Fast_GET_ITEM(seq, i), &view) == 0;
+        if (ok) {
+            views.push_back(view);
+            parts.push_back(FtdiIoVec((const char*)view.buf, (size_t)view.len));
+        }
+    }
+    Py_DECREF(seq);
+
+    int rc = ERR_NOT_OPENED;
+    if (ok) {
+        DEVICE_BEGIN_IO(self)
+        if (self->dev)
+            rc = self->dev->send(parts.data(), parts.size(), timeout);
+        DEVICE_END_IO(self)
+    }
+    for (size_t i = 0; i < views.size(); i++)
+        PyBuffer_Release(&views[i]);
+    if (!ok)
+        return NULL;
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_readList(Device* self, int size, double timeout)
+{
     Buffer<unsigned char> buff(size + 1);
     buff.zero();
-    int rc = self->dev->receive((char*)buff.data(), size, size, timeout);
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->receive((char*)buff.data(), size, size, timeout);
+    DEVICE_END_IO(self)
     PyObject* list = PyList_New(2);
 
     PyObject* dataout = PyList_New(rc > 0 ? rc : 0);
@@ -153,111 +487,2196 @@ static PyObject* device_read(Device* self, PyObject *args)
         for (int i = 0; i < rc; i++)
             PyList_SetItem(dataout, i, PyLong_FromLong(buff[i]));
 
-    PyList_SET_ITEM(list, 0, Py_BuildValue("i", rc));
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
     PyList_SET_ITEM(list, 1, dataout);
     return list;
 }
 
+static PyObject* device_read(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"size", "timeout", "as_list", NULL};
+    PyObject* values[3];
+    int size;
+    double timeout;
+    int asList = 0;
+    if (!pyParseArgs(args, nargs, kwnames, "read", kwlist, 2, values) || !pyArgInt(values[0], &size)
+        || !pyArgDouble(values[1], &timeout) || (values[2] && !pyArgBool(values[2], &asList)))
+        return NULL;
+    if (!self->dev)
+        return PyLong_FromLong(ERR_NOT_OPENED);
+    if (size < 0){
+        PyErr_SetString(PyExc_ValueError, "Invalid size.");
+        return NULL;
+    }
+
+    // legacy format: list of ints
+    if (asList)
+        return device_readList(self, size, timeout);
+
+    // received directly into the bytes object, shrunk afterwards to the received size
+    PyObject* dataout = PyBytes_FromStringAndSize(NULL, size);
+    if (!dataout)
+        return NULL;
+
+    int rc = ERR_NOT_OPENED;
+    char* buff = PyBytes_AS_STRING(dataout);
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = size > 0 ? self->dev->receive(buff, size, size, timeout) : 0;
+    DEVICE_END_IO(self)
+
+    if (_PyBytes_Resize(&dataout, rc > 0 ? rc : 0) < 0)
+        return NULL;
+
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, dataout);
+    return list;
+}
 
-static PyMemberDef device_members[] =
+static PyObject* device_readInto(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
 {
-   { NULL }
-};
+    static const char* const kwlist[] = {"buffer", "timeout", NULL};
+    PyObject* values[2];
+    double timeout;
+    if (!pyParseArgs(args, nargs, kwnames, "read_into", kwlist, 2, values) || !pyArgDouble(values[1], &timeout))
+        return NULL;
+    PyObject* data = values[0];
+    if (!self->dev)
+        return PyLong_FromLong(ERR_NOT_OPENED);
 
-static PyMethodDef device_methods[] =
+    // bytearray, memoryview, array, numpy... - received directly into its memory
+    Py_buffer view;
+    if (PyObject_GetBuffer(data, &view, PyBUF_WRITABLE) < 0)
+        return NULL;
+
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = view.len > 0 ? self->dev->receive((char*)view.buf, (size_t)view.len, (size_t)view.len, timeout) : 0;
+    DEVICE_END_IO(self)
+    PyBuffer_Release(&view);
+    return PyLong_FromLong(rc);
+}
+
+// exports non-empty pattern (any bytes-like object)
+static int getPatternBuffer(PyObject* pattern, Py_buffer* view)
 {
-    {"list_devices", (PyCFunction)device_listDevices, METH_VARARGS, "list_devices()"},
-    {"open", (PyCFunction)device_open, METH_VARARGS, "open(dev_name,baud,interface_index)"},
-    {"close", (PyCFunction)device_close, METH_VARARGS, "close()"},
-    {"set_sync_mode", (PyCFunction)device_setSyncMode, METH_VARARGS, "set_sync_mode(is_sync_mode)"},
-    {"is_connected", (PyCFunction)device_isConnected, METH_VARARGS, "is_connected()"},
-    {"clear_buffers", (PyCFunction)device_clearBuffers, METH_VARARGS, "clear_buffers()"},
-    {"send", (PyCFunction)device_send, METH_VARARGS, "send(data)"},
-    {"read", (PyCFunction)device_read, METH_VARARGS, "read(size, timeout)"},
-    { NULL }
-};
+    if (PyObject_GetBuffer(pattern, view, PyBUF_SIMPLE) < 0)
+        return -1;
+    if (view->len == 0) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "Empty pattern.");
+        return -1;
+    }
+    return 0;
+}
 
-PyTypeObject DeviceType =
-{
-   PyVarObject_HEAD_INIT(NULL, 0)
-   //PyObject_HEAD_INIT(NULL)
-   //0,                         /* ob_size */
-   "Device",               /* tp_name */
-   sizeof(Device),         /* tp_basicsize */
-   0,                         /* tp_itemsize */
-   (destructor)device_dealloc, /* tp_dealloc */
-   0,                         /* tp_print */
-   0,                         /* tp_getattr */
-   0,                         /* tp_setattr */
-   0,                         /* tp_compare */
-   0,                         /* tp_repr */
-   0,                         /* tp_as_number */
-   0,                         /* tp_as_sequence */
-   0,                         /* tp_as_mapping */
-   0,                         /* tp_hash */
-   0,                         /* tp_call */
-   0,                         /* tp_str */
-   0,                         /* tp_getattro */
-   0,                         /* tp_setattro */
-   0,                         /* tp_as_buffer */
-   Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags*/
-   "Device object",        /* tp_doc */
-   0,                         /* tp_traverse */
-   0,                         /* tp_clear */
-   0,                         /* tp_richcompare */
-   0,                         /* tp_weaklistoffset */
-   0,                         /* tp_iter */
-   0,                         /* tp_iternext */
-   device_methods,         /* tp_methods */
-   device_members,         /* tp_members */
-   0,                         /* tp_getset */
-   0,                         /* tp_base */
-   0,                         /* tp_dict */
-   0,                         /* tp_descr_get */
-   0,                         /* tp_descr_set */
-   0,                         /* tp_dictoffset */
-   (initproc)device_init,  /* tp_init */
-   0,                         /* tp_alloc */
-   0,                         /* tp_new */
-};
+static PyObject* device_readUntil(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"pattern", "max_size", "timeout", NULL};
+    PyObject* values[3];
+    Py_ssize_t size;
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "read_until", kwlist, 2, values) || !pyArgSize(values[1], &size)
+        || (values[2] && !pyArgDouble(values[2], &timeout)))
+        return NULL;
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid size.");
+        return NULL;
+    }
 
+    Py_buffer pattern;
+    if (getPatternBuffer(values[0], &pattern) < 0)
+        return NULL;
+    PyObject* dataout = PyBytes_FromStringAndSize(NULL, size);
+    if (!dataout) {
+        PyBuffer_Release(&pattern);
+        return NULL;
+    }
 
-//################################################################################
-//                      INIT MODULE
-//################################################################################
+    int rc = ERR_NOT_OPENED;
+    char* buff = PyBytes_AS_STRING(dataout);
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->receiveAllUntilPattern(buff, size, (char*)pattern.buf, pattern.len, timeout);
+    DEVICE_END_IO(self)
+    PyBuffer_Release(&pattern);
 
-static PyMethodDef module_methods[] = {
-    {"list_devices", (PyCFunction)device_listDevices, METH_VARARGS, "list_devices()"},
-    {NULL, NULL, 0, NULL}
-};
+    if (_PyBytes_Resize(&dataout, rc > 0 ? rc : 0) < 0)
+        return NULL;
+
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, dataout);
+    return list;
+}
 
+static PyObject* device_skipUntil(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"pattern", "timeout", NULL};
+    PyObject* values[2];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "skip_until", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
+        return NULL;
 
-static struct PyModuleDef moduledef = {
-    PyModuleDef_HEAD_INIT,
-    "py_ftdi",           /* m_name */
-    "Interface to ftdi",    /* m_doc */
-    -1,                  /* m_size */
-    module_methods,    /* m_methods */
-    NULL,                /* m_reload */
-    NULL,                /* m_traverse */
-    NULL,                /* m_clear */
-    NULL,                /* m_free */
-};
+    Py_buffer pattern;
+    if (getPatternBuffer(values[0], &pattern) < 0)
+        return NULL;
 
-PyMODINIT_FUNC PyInit_py_ftdi(void)
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->skipAllUntilPattern((char*)pattern.buf, pattern.len, timeout);
+    DEVICE_END_IO(self)
+    PyBuffer_Release(&pattern);
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_expect(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"patterns", "timeout", NULL};
+    PyObject* values[2];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "expect", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
+        return NULL;
+
+    PyObject* seq = PySequence_Fast(values[0], "patterns must be a sequence of bytes-like objects");
+    if (!seq)
+        return NULL;
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    std::vector<Py_buffer> views;
+    std::vector<FtdiIoVec> patterns;
+    views.reserve(count);
+    patterns.reserve(count);
+    bool ok = count > 0;
+    if (!ok)
+        PyErr_SetString(PyExc_ValueError, "No patterns.");
+    for (Py_ssize_t i = 0; i < count && ok; i++) {
+        Py_buffer view;
+        ok = getPatternBuffer(PySequence_Fast_GET_ITEM(seq, i), &view) == 0;
+        if (ok) {
+            views.push_back(view);
+            patterns.push_back(FtdiIoVec((const char*)view.buf, (size_t)view.len));
+        }
+    }
+    Py_DECREF(seq);
+
+    int rc = ERR_NOT_OPENED;
+    size_t offset = 0;
+    if (ok) {
+        DEVICE_BEGIN_IO(self)
+        if (self->dev)
+            rc = self->dev->expect(patterns.data(), patterns.size(), &offset, timeout);
+        DEVICE_END_IO(self)
+    }
+    for (size_t i = 0; i < views.size(); i++)
+        PyBuffer_Release(&views[i]);
+    if (!ok)
+        return NULL;
+
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, PyLong_FromSize_t(offset));
+    return list;
+}
+
+static bool getSeparator(PyObject* value, char* separ)
+{
+    Py_buffer sep;
+    if (PyObject_GetBuffer(value, &sep, PyBUF_SIMPLE) < 0)
+        return false;
+    bool valid = sep.len == 1;
+    if (valid)
+        *separ = ((char*)sep.buf)[0];
+    PyBuffer_Release(&sep);
+    if (!valid)
+        PyErr_SetString(PyExc_ValueError, "Separator must be a single byte.");
+    return valid;
+}
+
+static PyObject* device_readLine(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"sep", "timeout", NULL};
+    PyObject* values[2];
+    double timeout = 2;
+    char separ = '\n';
+    if (!pyParseArgs(args, nargs, kwnames, "readline", kwlist, 0, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout))
+        || (values[0] && !getSeparator(values[0], &separ)))
+        return NULL;
+
+    int rc = ERR_NOT_OPENED;
+    std::string line;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->getLine(line, separ, timeout);
+    DEVICE_END_IO(self)
+
+    PyObject* dataout = PyBytes_FromStringAndSize(line.data(), (Py_ssize_t)line.size());
+    if (!dataout)
+        return NULL;
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, dataout);
+    return list;
+}
+
+// all complete lines available (waits for the first one), the lines are copied from
+// the device input buffer directly to bytes objects
+static PyObject* device_readLines(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"max_lines", "timeout", "sep", NULL};
+    PyObject* values[3];
+    Py_ssize_t maxLines = 0;
+    double timeout = 2;
+    char separ = '\n';
+    if (!pyParseArgs(args, nargs, kwnames, "readlines", kwlist, 0, values)
+        || (values[0] && !pyArgSize(values[0], &maxLines))
+        || (values[1] && !pyArgDouble(values[1], &timeout))
+        || (values[2] && !getSeparator(values[2], &separ)))
+        return NULL;
+    if (maxLines < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid number of lines.");
+        return NULL;
+    }
+
+    // the views are valid until the next read, so the bytes objects are created with
+    // the device lock held
+    int rc = ERR_NOT_OPENED;
+    std::vector<FtdiIoVec> lines;
+    PyObject* lineList = NULL;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->readLines(lines, (size_t)maxLines, separ, timeout);
+    Py_BLOCK_THREADS
+    lineList = PyList_New(rc > 0 ? rc : 0);
+    for (int i = 0; lineList && i < rc; i++) {
+        PyObject* line = PyBytes_FromStringAndSize(lines[i].data, (Py_ssize_t)lines[i].size);
+        if (!line) {
+            Py_CLEAR(lineList);
+            break;
+        }
+        PyList_SET_ITEM(lineList, i, line);
+    }
+    Py_UNBLOCK_THREADS
+    DEVICE_END_IO(self)
+    if (!lineList)
+        return NULL;
+
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, lineList);
+    return list;
+}
+
+// struct module / memoryview format character of the data type
+static const char* dataTypeFormat(int dataType)
+{
+    switch (dataType) {
+        case DT_CHAR:   return "b";
+        case DT_BYTE:   return "B";
+        case DT_I16:    return "h";
+        case DT_U16:    return "H";
+        case DT_I32:    return "i";
+        case DT_U32:    return "I";
+        case DT_I64:    return "q";
+        case DT_U64:    return "Q";
+        case DT_FLOAT:  return "f";
+        case DT_DOUBLE: return "d";
+        case DT_BOOL:   return "i";
+        default:        return NULL;
+    }
+}
+
+static int parseEndianness(const char* name, Endianness* endianness)
+{
+    if (strcmp(name, "little") == 0)
+        *endianness = ENDIAN_LITTLE;
+    else if (strcmp(name, "big") == 0)
+        *endianness = ENDIAN_BIG;
+    else {
+        PyErr_SetString(PyExc_ValueError, "Endianness must be 'little' or 'big'.");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject* device_readArray(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
 {
-    PyObject* m = PyModule_Create(&moduledef);
-    if (m == NULL)
+    static const char* const kwlist[] = {"count", "dtype", "endianness", "timeout", NULL};
+    PyObject* values[4];
+    Py_ssize_t count;
+    int dataType;
+    const char* endianName;
+    double timeout;
+    if (!pyParseArgs(args, nargs, kwnames, "read_array", kwlist, 4, values) || !pyArgSize(values[0], &count)
+        || !pyArgInt(values[1], &dataType) || !pyArgString(values[2], &endianName) || !pyArgDouble(values[3], &timeout))
+        return NULL;
+
+    Endianness endianness;
+    if (parseEndianness(endianName, &endianness) < 0)
+        return NULL;
+    const char* format = dataTypeFormat(dataType);
+    if (!format){
+        PyErr_SetString(PyExc_ValueError, "Unsupported data type.");
+        return NULL;
+    }
+    size_t itemSize = dataTypeSize((DataType)dataType);
+    if (count < 0 || (size_t)count > (size_t)PY_SSIZE_T_MAX / itemSize){
+        PyErr_SetString(PyExc_ValueError, "Invalid count.");
+        return NULL;
+    }
+    if (!self->dev)
+        return PyLong_FromLong(ERR_NOT_OPENED);
+
+    // data are received into bytearray that is returned as typed memoryview
+    // (numpy.asarray() and array.array() take it without copying)
+    size_t size = (size_t)count * itemSize;
+    PyObject* bytes = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)size);
+    if (!bytes)
+        return NULL;
+
+    int rc = ERR_NOT_OPENED;
+    size_t items = 0;
+    char* buff = PyByteArray_AS_STRING(bytes);
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = size > 0 ? self->dev->receive(buff, size, size, timeout, false, itemSize) : 0;    // incomplete item stays in the input
+    items = rc > 0 ? (size_t)rc / itemSize : 0;
+    if (endianness != hostEndianness())
+        swapBytes(buff, buff, items, itemSize);
+    DEVICE_END_IO(self)
+
+    if (PyByteArray_Resize(bytes, (Py_ssize_t)(items * itemSize)) < 0){
+        Py_DECREF(bytes);
         return NULL;
+    }
+
+    PyObject* view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (!view)
+        return NULL;
+    PyObject* array = PyObject_CallMethod(view, "cast", "s", format);
+    Py_DECREF(view);
+    if (!array)
+        return NULL;
+
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, array);
+    return list;
+}
 
-    DeviceType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&DeviceType) < 0)
-        return m;
+// byte order of items described by buffer format string ("<H", ">i", "f", ...),
+// returns -1 for formats that are not single numeric items
+static int formatEndianness(const char* format, Endianness* endianness)
+{
+    if (!format)
+        format = "B";
+
+    *endianness = hostEndianness();
+    switch (format[0]) {
+        case '<': *endianness = ENDIAN_LITTLE; format++; break;
+        case '>':
+        case '!': *endianness = ENDIAN_BIG; format++; break;
+        case '@':
+        case '=': format++; break;
+    }
+
+    if (format[0] == '\0' || format[1] != '\0' || !strchr("bBhHiIlLqQnNefd?", format[0]))
+        return -1;
+    return 0;
+}
 
-    Py_INCREF(&DeviceType);
-    PyModule_AddObject(m, "Device", (PyObject*)&DeviceType);
+static PyObject* device_sendArray(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"array", "endianness", NULL};
+    PyObject* values[2];
+    const char* endianName;
+    if (!pyParseArgs(args, nargs, kwnames, "send_array", kwlist, 2, values) || !pyArgString(values[1], &endianName))
+        return NULL;
+    PyObject* data = values[0];
 
-    return m;
+    Endianness endianness;
+    if (parseEndianness(endianName, &endianness) < 0)
+        return NULL;
+
+    Py_buffer view;
+    if (PyObject_GetBuffer(data, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+        return NULL;
+
+    Endianness dataEndianness;
+    size_t itemSize = (size_t)view.itemsize;
+    if (formatEndianness(view.format, &dataEndianness) < 0 || (itemSize != 1 && itemSize != 2 && itemSize != 4 && itemSize != 8)){
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "Unsupported array type.");
+        return NULL;
+    }
+
+    // items are sent directly when already in the wire byte order,
+    // otherwise swapped into a temporary buffer
+    int rc = ERR_NOT_OPENED;
+    size_t size = (size_t)view.len;
+    bool swap = itemSize > 1 && dataEndianness != endianness;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev && size == 0)
+        rc = 0;
+    else if (self->dev && swap) {
+        Buffer<char> buff(size);
+        swapBytes(view.buf, buff.data(), size / itemSize, itemSize);
+        rc = self->dev->send(buff.data(), size);
+    } else if (self->dev)
+        rc = self->dev->send((char*)view.buf, size);
+    DEVICE_END_IO(self)
+    PyBuffer_Release(&view);
+    return PyLong_FromLong(rc);
+}
+
+static bool getBytes(PyObject* value, std::string* bytes)
+{
+    Py_buffer view;
+    if (PyObject_GetBuffer(value, &view, PyBUF_SIMPLE) < 0)
+        return false;
+    bytes->assign((const char*)view.buf, (size_t)view.len);
+    PyBuffer_Release(&view);
+    return true;
+}
+
+static PyObject* device_setFraming(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"kind", "size", "length_offset", "length_width", "endianness", "length_adjust",
+        "delimiter", "sync", "max_size", NULL};
+    PyObject* values[9];
+    int kind;
+    Py_ssize_t size = 0;
+    Py_ssize_t lengthOffset = 0;
+    Py_ssize_t lengthWidth = 1;
+    const char* endianName = "little";
+    Py_ssize_t lengthAdjust = 0;
+    Py_ssize_t maxSize = 0;
+    FtdiFrameFormat format;
+    if (!pyParseArgs(args, nargs, kwnames, "set_framing", kwlist, 1, values) || !pyArgInt(values[0], &kind)
+        || (values[1] && !pyArgSize(values[1], &size))
+        || (values[2] && !pyArgSize(values[2], &lengthOffset))
+        || (values[3] && !pyArgSize(values[3], &lengthWidth))
+        || (values[4] && !pyArgString(values[4], &endianName))
+        || (values[5] && !pyArgSize(values[5], &lengthAdjust))
+        || (values[6] && !getBytes(values[6], &format.delimiter))
+        || (values[7] && !getBytes(values[7], &format.sync))
+        || (values[8] && !pyArgSize(values[8], &maxSize)))
+        return NULL;
+    Endianness endianness;
+    if (parseEndianness(endianName, &endianness) < 0)
+        return NULL;
+    if (kind < FtdiFrameFormat::FRAME_NONE || kind > FtdiFrameFormat::FRAME_DELIMITER || size < 0 || lengthOffset < 0
+        || lengthWidth < 0 || maxSize < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid frame format.");
+        return NULL;
+    }
+    format.kind = (FtdiFrameFormat::Kind)kind;
+    format.size = (size_t)size;
+    format.lengthOffset = (size_t)lengthOffset;
+    format.lengthWidth = (size_t)lengthWidth;
+    format.bigEndian = endianness == ENDIAN_BIG;
+    format.lengthAdjust = lengthAdjust;
+    format.maxSize = (size_t)maxSize;
+    if (!format.isValid()) {
+        PyErr_SetString(PyExc_ValueError, "Invalid frame format.");
+        return NULL;
+    }
+
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (!self->frameFormat)
+        self->frameFormat = new FtdiFrameFormat();
+    *self->frameFormat = format;
+    if (self->dev)
+        rc = self->dev->setFraming(format);
+    DEVICE_END_IO(self)
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_readFrames(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"max_frames", "timeout", NULL};
+    PyObject* values[2];
+    Py_ssize_t maxFrames = 0;
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "read_frames", kwlist, 0, values)
+        || (values[0] && !pyArgSize(values[0], &maxFrames))
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
+        return NULL;
+    if (maxFrames < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid number of frames.");
+        return NULL;
+    }
+
+    // the views are valid until the next read, as in readlines
+    int rc = ERR_NOT_OPENED;
+    std::vector<FtdiFrame> frames;
+    PyObject* frameList = NULL;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->readFrames(frames, (size_t)maxFrames, timeout);
+    Py_BLOCK_THREADS
+    frameList = PyList_New(rc > 0 ? rc : 0);
+    for (int i = 0; frameList && i < rc; i++) {
+        PyObject* data = PyBytes_FromStringAndSize(frames[i].data, (Py_ssize_t)frames[i].size);
+        PyObject* frame = data ? Py_BuildValue("(Nd)", data, frames[i].time) : NULL;
+        if (!frame) {
+            Py_CLEAR(frameList);
+            break;
+        }
+        PyList_SET_ITEM(frameList, i, frame);
+    }
+    Py_UNBLOCK_THREADS
+    DEVICE_END_IO(self)
+    if (!frameList)
+        return NULL;
+
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, frameList);
+    return list;
+}
+
+static PyObject* device_framingDropped(Device* self, PyObject* Py_UNUSED(args))
+{
+    unsigned long long dropped = 0;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        dropped = self->dev->framingDropped();
+    DEVICE_END_IO(self)
+    return PyLong_FromUnsignedLongLong(dropped);
+}
+
+// synchronous bit bang - data are written and the same number of samples is read back
+static PyObject* device_exchange(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"data", "timeout", "window", NULL};
+    PyObject* values[3];
+    double timeout = 2;
+    Py_ssize_t window = 0;
+    if (!pyParseArgs(args, nargs, kwnames, "exchange", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)) || (values[2] && !pyArgSize(values[2], &window)))
+        return NULL;
+    if (window < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid window.");
+        return NULL;
+    }
+
+    Py_buffer view;
+    if (getDataBuffer(values[0], &view) < 0)
+        return NULL;
+    PyObject* data = PyBytes_FromStringAndSize(NULL, view.len);
+    if (!data) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    int rc = ERR_NOT_OPENED;
+    DEVICE_BEGIN_IO(self)
+    if (self->dev)
+        rc = self->dev->exchange((const char*)view.buf, PyBytes_AS_STRING(data), (size_t)view.len, timeout, (size_t)window);
+    DEVICE_END_IO(self)
+    PyBuffer_Release(&view);
+
+    if (_PyBytes_Resize(&data, rc > 0 ? rc : 0) < 0)
+        return NULL;
+    PyObject* list = PyList_New(2);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, data);
+    return list;
+}
+
+static PyObject* device_transact(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"items", "timeout", "window", NULL};
+    PyObject* values[3];
+    double timeout = 2;
+    Py_ssize_t window = 0;
+    if (!pyParseArgs(args, nargs, kwnames, "transact", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)) || (values[2] && !pyArgSize(values[2], &window)))
+        return NULL;
+    if (window < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid window.");
+        return NULL;
+    }
+
+    PyObject* seq = PySequence_Fast(values[0], "items must be a sequence of (payload, response_size)");
+    if (!seq)
+        return NULL;
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    std::vector<Py_buffer> views;
+    std::vector<FtdiTransaction> items(count);
+    std::vector<size_t> offsets(count + 1);
+    views.reserve(count);
+    size_t expected = 0;
+    bool ok = true;
+    for (Py_ssize_t i = 0; i < count && ok; i++) {
+        PyObject* item = PySequence_Fast(PySequence_Fast_GET_ITEM(seq, i), "items must be a sequence of (payload, response_size)");
+        Py_ssize_t rxSize = 0;
+        ok = item && PySequence_Fast_GET_SIZE(item) == 2;
+        if (item && !ok)
+            PyErr_SetString(PyExc_TypeError, "items must be a sequence of (payload, response_size)");
+        ok = ok && pyArgSize(PySequence_Fast_GET_ITEM(item, 1), &rxSize);
+        if (ok && rxSize < 0) {
+            PyErr_SetString(PyExc_ValueError, "Invalid response size.");
+            ok = false;
+        }
+        if (ok) {
+            Py_buffer view;
+            ok = getDataBuffer(PySequence_Fast_GET_ITEM(item, 0), &view) == 0;
+            if (ok) {
+                views.push_back(view);
+                items[i] = FtdiTransaction((char*)view.buf, (size_t)view.len, (size_t)rxSize);
+                expected += (size_t)rxSize;
+            }
+        }
+        Py_XDECREF(item);
+    }
+    Py_DECREF(seq);
+
+    PyObject* data = ok ? PyBytes_FromStringAndSize(NULL, (Py_ssize_t)expected) : NULL;
+    int rc = ERR_NOT_OPENED;
+    if (data) {
+        DEVICE_BEGIN_IO(self)
+        if (self->dev)
+            rc = self->dev->transact(items.data(), items.size(), PyBytes_AS_STRING(data), expected, offsets.data(), timeout, (size_t)window);
+        DEVICE_END_IO(self)
+    }
+    for (size_t i = 0; i < views.size(); i++)
+        PyBuffer_Release(&views[i]);
+    if (!data)
+        return NULL;
+
+    if (rc < 0)
+        std::fill(offsets.begin(), offsets.end(), 0);
+    if (_PyBytes_Resize(&data, rc > 0 ? rc : 0) < 0)
+        return NULL;
+
+    PyObject* offsetList = PyList_New(count + 1);
+    if (!offsetList) {
+        Py_DECREF(data);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i <= count; i++)
+        PyList_SET_ITEM(offsetList, i, PyLong_FromSize_t(offsets[i]));
+
+    PyObject* list = PyList_New(3);
+    PyList_SET_ITEM(list, 0, PyLong_FromLong(rc));
+    PyList_SET_ITEM(list, 1, data);
+    PyList_SET_ITEM(list, 2, offsetList);
+    return list;
+}
+
+
+//################################################################################
+//                      STREAMING
+//################################################################################
+
+// Device.stream() returns an iterator fed by a native reader thread. The data are
+// read to a fixed set of chunk buffers and yielded as read-only memoryviews. When
+// the consumer releases a view, its chunk goes back to the reader, so the steady
+// state loop does not allocate or copy the data. The device lock is taken per
+// chunk, so other calls on the device may run between chunks.
+struct StreamChunk;
+
+struct StreamPool
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<StreamChunk*> free;    // chunks the reader can fill
+    std::deque<StreamChunk*> ready;   // filled chunks waiting for the consumer
+    std::thread thread;
+    std::mutex threadMutex;           // serializes joining of the reader
+    size_t refs;                      // stream + chunks, guarded by mutex
+    bool stop;
+    bool finished;
+    int rc;
+};
+
+typedef struct StreamChunk {
+    PyObject_HEAD
+    StreamPool* pool;
+    char* data;
+    size_t size;
+    Py_ssize_t exports;
+} StreamChunk;
+
+typedef struct {
+    PyObject_HEAD
+    Device* device;
+    StreamPool* pool;
+    PyObject* chunks;   // tuple owning all chunks
+    size_t chunkSize;
+    double timeout;
+} DeviceStream;
+
+static void streamPoolRelease(StreamPool* pool)
+{
+    bool last;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        last = --pool->refs == 0;
+    }
+    if (last)
+        delete pool;
+}
+
+static void streamReaderRun(Device* device, StreamPool* pool, size_t chunkSize, double timeout)
+{
+    while (true) {
+        StreamChunk* chunk;
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->cond.wait(lock, [pool]{ return pool->stop || !pool->free.empty(); });
+            if (pool->stop)
+                break;
+            chunk = pool->free.front();
+            pool->free.pop_front();
+        }
+
+        int rc = ERR_NOT_OPENED;
+        PyThread_acquire_lock(device->lock, WAIT_LOCK);
+        if (device->dev)
+            rc = device->dev->receive(chunk->data, chunkSize, chunkSize, timeout);
+        PyThread_release_lock(device->lock);
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (rc > 0) {
+            chunk->size = (size_t)rc;
+            pool->ready.push_back(chunk);
+        } else {
+            pool->free.push_back(chunk);
+            pool->rc = rc;
+            pool->stop = true;
+        }
+        pool->cond.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->finished = true;
+    pool->cond.notify_all();
+}
+
+static void streamStop(DeviceStream* self)
+{
+    StreamPool* pool = self->pool;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stop = true;
+        pool->cond.notify_all();
+    }
+    Py_BEGIN_ALLOW_THREADS
+    std::lock_guard<std::mutex> lock(pool->threadMutex);
+    if (pool->thread.joinable())
+        pool->thread.join();
+    Py_END_ALLOW_THREADS
+
+    // chunks not taken yet are dropped
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    while (!pool->ready.empty()) {
+        pool->free.push_back(pool->ready.front());
+        pool->ready.pop_front();
+    }
+}
+
+static int chunk_getBuffer(StreamChunk* self, Py_buffer* view, int flags)
+{
+    std::lock_guard<std::mutex> lock(self->pool->mutex);
+    if (PyBuffer_FillInfo(view, (PyObject*)self, self->data, (Py_ssize_t)self->size, 1, flags) < 0)
+        return -1;
+    self->exports++;
+    return 0;
+}
+
+// last released view returns the chunk to the reader
+static void chunk_releaseBuffer(StreamChunk* self, Py_buffer* Py_UNUSED(view))
+{
+    StreamPool* pool = self->pool;
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    if (--self->exports == 0) {
+        pool->free.push_back(self);
+        pool->cond.notify_all();
+    }
+}
+
+static void chunk_dealloc(StreamChunk* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    PyMem_RawFree(self->data);
+    if (self->pool)
+        streamPoolRelease(self->pool);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+static PyType_Slot chunk_slots[] =
+{
+    {Py_tp_dealloc, (void*)chunk_dealloc},
+    {Py_bf_getbuffer, (void*)chunk_getBuffer},
+    {Py_bf_releasebuffer, (void*)chunk_releaseBuffer},
+    {Py_tp_doc, (void*)"Data chunk of a device stream"},
+    {0, NULL}
+};
+
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define Py_TPFLAGS_DISALLOW_INSTANTIATION 0
+#endif
+
+static PyType_Spec chunk_spec =
+{
+    "py_ftdi.StreamChunk",                                  /* name */
+    sizeof(StreamChunk),                                    /* basicsize */
+    0,                                                      /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /* flags */
+    chunk_slots,                                            /* slots */
+};
+
+static PyObject* stream_next(DeviceStream* self)
+{
+    StreamPool* pool = self->pool;
+    StreamChunk* chunk = NULL;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    if (pool->ready.empty() && !pool->finished) {
+        lock.unlock();
+        Py_BEGIN_ALLOW_THREADS
+        lock.lock();
+        pool->cond.wait(lock, [pool]{ return pool->finished || !pool->ready.empty(); });
+        lock.unlock();
+        Py_END_ALLOW_THREADS
+        lock.lock();
+    }
+    if (pool->ready.empty())
+        return NULL;
+    chunk = pool->ready.front();
+    pool->ready.pop_front();
+    lock.unlock();
+
+    PyObject* view = PyMemoryView_FromObject((PyObject*)chunk);
+    if (!view) {
+        lock.lock();
+        pool->free.push_back(chunk);
+        pool->cond.notify_all();
+    }
+    return view;
+}
+
+static PyObject* stream_close(DeviceStream* self, PyObject* Py_UNUSED(args))
+{
+    streamStop(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* stream_enter(DeviceStream* self, PyObject* Py_UNUSED(args))
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* stream_exit(DeviceStream* self, PyObject* const* Py_UNUSED(args), Py_ssize_t Py_UNUSED(nargs))
+{
+    streamStop(self);
+    Py_RETURN_FALSE;
+}
+
+static PyObject* stream_getRc(DeviceStream* self, void* Py_UNUSED(closure))
+{
+    std::lock_guard<std::mutex> lock(self->pool->mutex);
+    return PyLong_FromLong(self->pool->rc);
+}
+
+static void stream_dealloc(DeviceStream* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    if (self->pool) {
+        streamStop(self);
+        streamPoolRelease(self->pool);
+    }
+    Py_XDECREF(self->chunks);
+    Py_XDECREF(self->device);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+static PyMethodDef stream_methods[] =
+{
+    {"close", (PyCFunction)stream_close, METH_NOARGS, "close()"},
+    {"__enter__", (PyCFunction)stream_enter, METH_NOARGS, NULL},
+    {"__exit__", PyFastCFunction(stream_exit), METH_FASTCALL, NULL},
+    { NULL }
+};
+
+static PyGetSetDef stream_getset[] =
+{
+    {"rc", (getter)stream_getRc, NULL, "return code that ended the stream (0 = timeout without data)", NULL},
+    { NULL }
+};
+
+static PyType_Slot stream_slots[] =
+{
+    {Py_tp_dealloc, (void*)stream_dealloc},
+    {Py_tp_iter, (void*)PyObject_SelfIter},
+    {Py_tp_iternext, (void*)stream_next},
+    {Py_tp_methods, stream_methods},
+    {Py_tp_getset, stream_getset},
+    {Py_tp_doc, (void*)"Iterator over data chunks of a device"},
+    {0, NULL}
+};
+
+static PyType_Spec stream_spec =
+{
+    "py_ftdi.DeviceStream",                                 /* name */
+    sizeof(DeviceStream),                                   /* basicsize */
+    0,                                                      /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /* flags */
+    stream_slots,                                           /* slots */
+};
+
+static PyObject* device_stream(Device* self, PyTypeObject* cls, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    static const char* const kwlist[] = {"chunk_size", "timeout", "buffers", NULL};
+    PyObject* values[3];
+    Py_ssize_t chunkSize;
+    double timeout = 2;
+    int buffers = 4;
+    if (!pyParseArgs(args, nargs, kwnames, "stream", kwlist, 1, values) || !pyArgSize(values[0], &chunkSize)
+        || (values[1] && !pyArgDouble(values[1], &timeout)) || (values[2] && !pyArgInt(values[2], &buffers)))
+        return NULL;
+    if (chunkSize <= 0 || buffers < 2) {
+        PyErr_SetString(PyExc_ValueError, chunkSize <= 0 ? "Invalid chunk size." : "At least 2 buffers are needed.");
+        return NULL;
+    }
+
+    PyObject* module = PyType_GetModule(cls);
+    if (!module)
+        return NULL;
+    ModuleState* state = moduleState(module);
+
+    DeviceStream* stream = PyObject_New(DeviceStream, (PyTypeObject*)state->streamType);
+    if (!stream)
+        return NULL;
+    Py_INCREF(self);
+    stream->device = self;
+    stream->chunkSize = (size_t)chunkSize;
+    stream->timeout = timeout;
+    stream->chunks = PyTuple_New(buffers);
+    stream->pool = new StreamPool();
+    stream->pool->refs = 1;
+    stream->pool->stop = false;
+    stream->pool->finished = false;
+    stream->pool->rc = 0;
+    if (!stream->chunks) {
+        Py_DECREF(stream);
+        return NULL;
+    }
+
+    for (int i = 0; i < buffers; i++) {
+        StreamChunk* chunk = PyObject_New(StreamChunk, (PyTypeObject*)state->chunkType);
+        if (!chunk) {
+            Py_DECREF(stream);
+            return NULL;
+        }
+        chunk->pool = NULL;
+        chunk->size = 0;
+        chunk->exports = 0;
+        chunk->data = (char*)PyMem_RawMalloc((size_t)chunkSize);
+        PyTuple_SET_ITEM(stream->chunks, i, (PyObject*)chunk);
+        if (!chunk->data) {
+            Py_DECREF(stream);
+            return PyErr_NoMemory();
+        }
+        chunk->pool = stream->pool;
+        stream->pool->refs++;
+        stream->pool->free.push_back(chunk);
+    }
+
+    stream->pool->thread = std::thread(streamReaderRun, self, stream->pool, stream->chunkSize, timeout);
+    return (PyObject*)stream;
+}
+
+
+//################################################################################
+//                      DATA CALLBACKS
+//################################################################################
+
+// Device.set_on_data() taps FtdiDev data through setOnDataFunc. The tap only
+// appends the data to a native batch (it runs in the I/O thread without the GIL).
+// A flusher thread hands the batches to the Python callback when they reach
+// max_batch_bytes or max_latency_ms after their first byte. Batches are split
+// when the direction changes, so each one is either rx or tx data.
+struct DataBatch
+{
+    std::string data;
+    bool tx;
+};
+
+struct DataTap
+{
+    PyObject* callback;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    DataBatch batch;                  // batch being filled
+    std::chrono::steady_clock::time_point batchStart;
+    std::deque<DataBatch> full;       // batches waiting for delivery
+    size_t maxBatch;
+    std::chrono::microseconds maxLatency;
+    bool withTx;
+    bool txArg;      // callback(data, is_tx), otherwise callback(data)
+    bool stop;
+    bool detached;   // stopped from the callback, deletes itself on exit
+};
+
+// called by FtdiDev after every transfer
+static void dataTapOnData(char* data, unsigned size, bool tx, void* userData)
+{
+    DataTap* tap = (DataTap*)userData;
+    if (size == 0 || (tx && !tap->withTx))
+        return;
+
+    std::lock_guard<std::mutex> lock(tap->mutex);
+    if (!tap->batch.data.empty() && tap->batch.tx != tx) {
+        tap->full.push_back(DataBatch());
+        tap->full.back().data.swap(tap->batch.data);
+        tap->full.back().tx = tap->batch.tx;
+    }
+    bool first = tap->batch.data.empty();
+    if (first) {
+        tap->batch.tx = tx;
+        tap->batchStart = std::chrono::steady_clock::now();
+    }
+    tap->batch.data.append(data, size);
+    if (tap->batch.data.size() >= tap->maxBatch) {
+        tap->full.push_back(DataBatch());
+        tap->full.back().data.swap(tap->batch.data);
+        tap->full.back().tx = tx;
+    }
+    if (first || !tap->full.empty())
+        tap->cond.notify_one();
+}
+
+static void dataTapDeliver(DataTap* tap, std::deque<DataBatch>& batches)
+{
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    for (size_t i = 0; i < batches.size(); i++) {
+        PyObject* data = PyBytes_FromStringAndSize(batches[i].data.data(), (Py_ssize_t)batches[i].data.size());
+        PyObject* res = NULL;
+        if (data && tap->txArg)
+            res = PyObject_CallFunctionObjArgs(tap->callback, data, batches[i].tx ? Py_True : Py_False, NULL);
+        else if (data)
+            res = PyObject_CallOneArg(tap->callback, data);
+        if (!res)
+            PyErr_WriteUnraisable(tap->callback);
+        Py_XDECREF(res);
+        Py_XDECREF(data);
+    }
+    PyGILState_Release(gstate);
+    batches.clear();
+}
+
+static void dataTapRun(DataTap* tap)
+{
+    std::deque<DataBatch> batches;
+    std::unique_lock<std::mutex> lock(tap->mutex);
+    while (true) {
+        if (!tap->full.empty()) {
+            batches.swap(tap->full);
+            lock.unlock();
+            dataTapDeliver(tap, batches);
+            lock.lock();
+            continue;
+        }
+
+        // batch is closed when its latency expires (or on stop)
+        if (!tap->batch.data.empty()) {
+            std::chrono::steady_clock::time_point deadline = tap->batchStart + tap->maxLatency;
+            if (tap->stop || std::chrono::steady_clock::now() >= deadline) {
+                tap->full.push_back(DataBatch());
+                tap->full.back().data.swap(tap->batch.data);
+                tap->full.back().tx = tap->batch.tx;
+            } else
+                tap->cond.wait_until(lock, deadline);
+            continue;
+        }
+
+        if (tap->stop)
+            break;
+        tap->cond.wait(lock);
+    }
+
+    bool detached = tap->detached;
+    lock.unlock();
+    if (detached) {
+        PyGILState_STATE gstate = PyGILState_Ensure();
+        Py_DECREF(tap->callback);
+        PyGILState_Release(gstate);
+        delete tap;
+    }
+}
+
+static DataTap* dataTapNew(PyObject* callback, size_t maxBatch, double maxLatencyMs, bool withTx, bool txArg)
+{
+    DataTap* tap = new DataTap();
+    tap->callback = callback;
+    Py_INCREF(callback);
+    tap->maxBatch = maxBatch;
+    tap->maxLatency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::duration<double, std::milli>(maxLatencyMs));
+    tap->withTx = withTx;
+    tap->txArg = txArg;
+    tap->stop = false;
+    tap->detached = false;
+    tap->thread = std::thread(dataTapRun, tap);
+    return tap;
+}
+
+// remaining data are delivered before the flusher ends
+static void dataTapStop(DataTap* tap)
+{
+    if (!tap)
+        return;
+
+    bool ownThread = tap->thread.get_id() == std::this_thread::get_id();
+    {
+        std::lock_guard<std::mutex> lock(tap->mutex);
+        tap->stop = true;
+        tap->detached = ownThread;
+        tap->cond.notify_one();
+    }
+    if (ownThread) {
+        tap->thread.detach();
+        return;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    tap->thread.join();
+    Py_END_ALLOW_THREADS
+    Py_DECREF(tap->callback);
+    delete tap;
+}
+
+static PyObject* device_setOnData(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"callback", "max_batch_bytes", "max_latency_ms", "tx", NULL};
+    PyObject* values[4];
+    Py_ssize_t maxBatch = 65536;
+    double maxLatency = 50;
+    int withTx = 0;
+    if (!pyParseArgs(args, nargs, kwnames, "set_on_data", kwlist, 1, values)
+        || (values[1] && !pyArgSize(values[1], &maxBatch)) || (values[2] && !pyArgDouble(values[2], &maxLatency))
+        || (values[3] && !pyArgBool(values[3], &withTx)))
+        return NULL;
+    PyObject* callback = values[0];
+    if (callback != Py_None && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable or None");
+        return NULL;
+    }
+    if (maxBatch <= 0 || maxLatency < 0) {
+        PyErr_SetString(PyExc_ValueError, maxBatch <= 0 ? "Invalid batch size." : "Invalid latency.");
+        return NULL;
+    }
+
+    DataTap* tap = callback != Py_None ? dataTapNew(callback, (size_t)maxBatch, maxLatency, withTx != 0, true) : NULL;
+
+    DataTap* oldTap;
+    DEVICE_BEGIN_IO(self)
+    oldTap = self->tap;
+    self->tap = tap;
+    if (self->dev)
+        self->dev->setOnDataFunc(tap ? dataTapOnData : NULL, tap);
+    DEVICE_END_IO(self)
+
+    dataTapStop(oldTap);
+    Py_RETURN_NONE;
+}
+
+
+//################################################################################
+//                      SYNCHRONOUS FIFO STREAMING
+//################################################################################
+
+// start_fifo_stream() runs FtdiDev::readStream in a native thread. The received
+// data go to a DataTap, so the Python callback gets them in batches the same way
+// as with set_on_data. The stream thread holds the device lock, other calls on the
+// device wait until the stream is stopped.
+struct FifoStream
+{
+    std::thread thread;
+    std::mutex mutex;
+    DataTap* tap;           // batches for the callback
+    FtdiStreamStats stats;  // final statistics
+    FtdiDev* dev;           // device while the stream runs
+    bool stop;              // stop requested before the stream started
+    int rc;
+};
+
+static int fifoStreamSink(char* data, size_t size, void* userData)
+{
+    dataTapOnData(data, (unsigned)size, false, userData);
+    return 0;
+}
+
+static void fifoStreamRun(Device* self, FifoStream* fifo, int packetsPerTransfer, int numTransfers)
+{
+    int rc = ERR_NOT_OPENED;
+    FtdiStreamStats stats;
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    {
+        std::lock_guard<std::mutex> lock(fifo->mutex);
+        fifo->dev = fifo->stop ? NULL : self->dev;
+        rc = fifo->stop ? 0 : rc;
+    }
+    if (fifo->dev) {
+        rc = fifo->dev->readStream(fifoStreamSink, fifo->tap, packetsPerTransfer, numTransfers);
+        stats = fifo->dev->streamStats();
+    }
+    {
+        std::lock_guard<std::mutex> lock(fifo->mutex);
+        fifo->rc = rc;
+        fifo->stats = stats;
+        fifo->dev = NULL;
+    }
+    PyThread_release_lock(self->lock);
+}
+
+// stops the stream, remaining data are delivered, returns rc of the stream
+static int fifoStreamStop(Device* self)
+{
+    FifoStream* fifo;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    fifo = self->fifo;
+    self->fifo = NULL;
+    Py_END_CRITICAL_SECTION();
+    if (!fifo)
+        return 0;
+
+    {
+        std::lock_guard<std::mutex> lock(fifo->mutex);
+        fifo->stop = true;
+        if (fifo->dev)
+            fifo->dev->stopStream();
+    }
+    Py_BEGIN_ALLOW_THREADS
+    fifo->thread.join();
+    Py_END_ALLOW_THREADS
+    dataTapStop(fifo->tap);
+    int rc = fifo->rc;
+    delete fifo;
+    return rc;
+}
+
+static PyObject* device_startFifoStream(Device* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"callback", "max_batch_bytes", "max_latency_ms", "packets_per_transfer", "num_transfers", NULL};
+    PyObject* values[5];
+    Py_ssize_t maxBatch = 1 << 20;
+    double maxLatency = 50;
+    int packetsPerTransfer = 8;
+    int numTransfers = 256;
+    if (!pyParseArgs(args, nargs, kwnames, "start_fifo_stream", kwlist, 1, values)
+        || (values[1] && !pyArgSize(values[1], &maxBatch)) || (values[2] && !pyArgDouble(values[2], &maxLatency))
+        || (values[3] && !pyArgInt(values[3], &packetsPerTransfer)) || (values[4] && !pyArgInt(values[4], &numTransfers)))
+        return NULL;
+    if (!PyCallable_Check(values[0])) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (maxBatch <= 0 || maxLatency < 0 || packetsPerTransfer <= 0 || numTransfers <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid stream parameters.");
+        return NULL;
+    }
+
+    int rc = 0;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (self->fifo) {
+        rc = -1;
+    } else {
+        FifoStream* fifo = new FifoStream();
+        fifo->tap = dataTapNew(values[0], (size_t)maxBatch, maxLatency, false, false);
+        fifo->dev = NULL;
+        fifo->stop = false;
+        fifo->rc = 0;
+        fifo->thread = std::thread(fifoStreamRun, self, fifo, packetsPerTransfer, numTransfers);
+        self->fifo = fifo;
+    }
+    Py_END_CRITICAL_SECTION();
+    return PyLong_FromLong(rc);
+}
+
+static PyObject* device_stopFifoStream(Device* self, PyObject* Py_UNUSED(args))
+{
+    return PyLong_FromLong(fifoStreamStop(self));
+}
+
+static PyObject* device_fifoStreamStats(Device* self, PyObject* Py_UNUSED(args))
+{
+    FtdiStreamStats stats;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (self->fifo) {
+        std::lock_guard<std::mutex> lock(self->fifo->mutex);
+        stats = self->fifo->dev ? self->fifo->dev->streamStats() : self->fifo->stats;
+    }
+    Py_END_CRITICAL_SECTION();
+    return Py_BuildValue("{s:K,s:d,s:d,s:d,s:O}", "total_bytes", stats.totalBytes, "total_time", stats.totalTime,
+                         "total_rate", stats.totalRate, "current_rate", stats.currentRate,
+                         "running", stats.running ? Py_True : Py_False);
+}
+
+
+//################################################################################
+//                      ASYNC OPERATIONS
+//################################################################################
+
+// Operations queued by read_async/send_async. They are executed by a native
+// worker thread of the device (one per device, created on first use) without
+// the GIL. Finished operations are put to a completion queue and an eventfd/pipe
+// watched by the asyncio event loop is signaled. The loop then sets results of
+// the futures in its own thread. Operations of DeviceGroup have no future, their
+// completion is counted by a latch the caller waits on.
+struct DeviceOpLatch
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t pending;
+};
+
+struct DeviceOp
+{
+    enum Kind {OP_SEND, OP_READ, OP_TRANSACT};
+    Kind kind;
+    Device* device;      // strong reference, device lives until the op is completed
+    PyObject* module;    // module of the device type (module state)
+    PyObject* future;    // asyncio future of the operation
+    PyObject* loop;      // event loop of the future
+    PyObject* data;      // OP_READ, OP_TRANSACT: bytes object the data are received to
+    Py_buffer view;      // OP_SEND, OP_TRANSACT: exported data to send
+    DeviceOpLatch* latch;   // group operation, NULL for async ones
+    size_t size;
+    double timeout;
+    int rc;
+};
+
+struct DeviceWorker
+{
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<DeviceOp*> queue;
+    bool stop;
+    bool detached;   // stopped from its own thread, deletes itself on exit
+};
+
+static void asyncOpDone(DeviceOp* op);
+
+static void deviceWorkerRun(Device* self, DeviceWorker* worker)
+{
+    while (true) {
+        DeviceOp* op = NULL;
+        {
+            std::unique_lock<std::mutex> lock(worker->mutex);
+            worker->cond.wait(lock, [worker]{ return worker->stop || !worker->queue.empty(); });
+            if (worker->queue.empty())
+                break;
+            op = worker->queue.front();
+            worker->queue.pop_front();
+        }
+
+        op->rc = ERR_NOT_OPENED;
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        if (self->dev) {
+            if (op->kind == DeviceOp::OP_READ) {
+                op->rc = op->size > 0 ? self->dev->receive(PyBytes_AS_STRING(op->data), op->size, op->size, op->timeout) : 0;
+            } else if (op->kind == DeviceOp::OP_SEND) {
+                op->rc = op->size > 0 ? self->dev->send((char*)op->view.buf, op->size, op->timeout) : 0;
+            } else {
+                op->rc = op->view.len > 0 ? self->dev->send((char*)op->view.buf, (size_t)op->view.len, op->timeout) : 0;
+                if (op->rc >= 0)
+                    op->rc = op->size > 0 ? self->dev->receive(PyBytes_AS_STRING(op->data), op->size, op->size, op->timeout) : 0;
+            }
+        }
+        PyThread_release_lock(self->lock);
+        if (op->latch) {
+            std::lock_guard<std::mutex> lock(op->latch->mutex);
+            if (--op->latch->pending == 0)
+                op->latch->cond.notify_all();
+        } else
+            asyncOpDone(op);
+    }
+
+    bool detached;
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        detached = worker->detached;
+    }
+    if (detached)
+        delete worker;
+}
+
+static void deviceWorkerSubmit(Device* self, DeviceOp* op)
+{
+    DeviceWorker* worker;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!self->worker) {
+        self->worker = new DeviceWorker();
+        self->worker->stop = false;
+        self->worker->detached = false;
+        self->worker->thread = std::thread(deviceWorkerRun, self, self->worker);
+    }
+    worker = self->worker;
+    Py_END_CRITICAL_SECTION();
+
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->queue.push_back(op);
+    worker->cond.notify_one();
+}
+
+static void deviceWorkerStop(Device* self)
+{
+    DeviceWorker* worker = self->worker;
+    if (!worker)
+        return;
+    self->worker = NULL;
+
+    bool ownThread = worker->thread.get_id() == std::this_thread::get_id();
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->stop = true;
+        worker->detached = ownThread;
+        worker->cond.notify_one();
+    }
+    if (ownThread) {
+        worker->thread.detach();
+        return;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    worker->thread.join();
+    Py_END_ALLOW_THREADS
+    delete worker;
+}
+
+// result of finished operation (read: [rc, bytes], send: rc), releases op data
+static PyObject* asyncOpResult(DeviceOp* op)
+{
+    PyObject* result = NULL;
+    if (op->kind == DeviceOp::OP_READ) {
+        if (_PyBytes_Resize(&op->data, op->rc > 0 ? op->rc : 0) == 0) {
+            result = PyList_New(2);
+            PyList_SET_ITEM(result, 0, PyLong_FromLong(op->rc));
+            PyList_SET_ITEM(result, 1, op->data);
+            op->data = NULL;
+        }
+    } else {
+        PyBuffer_Release(&op->view);
+        result = PyLong_FromLong(op->rc);
+    }
+    return result;
+}
+
+static void asyncOpFree(DeviceOp* op)
+{
+    Py_XDECREF(op->data);
+    Py_DECREF(op->future);
+    Py_DECREF(op->loop);
+    Py_DECREF(op->device);
+    Py_DECREF(op->module);
+    delete op;
+}
+
+// schedules setting of the future result in the future's event loop
+static void asyncOpComplete(DeviceOp* op, PyObject* currentLoop)
+{
+    PyObject* setFutureResult = moduleState(op->module)->setFutureResult;
+    PyObject* result = asyncOpResult(op);
+    if (!result) {
+        PyErr_WriteUnraisable(op->future);
+    } else if (op->loop == currentLoop) {
+        PyObject* rc = PyObject_CallFunctionObjArgs(setFutureResult, op->future, result, NULL);
+        if (!rc)
+            PyErr_WriteUnraisable(op->future);
+        Py_XDECREF(rc);
+    } else {
+        // device passed along so it is not released in its own worker thread
+        PyObject* rc = PyObject_CallMethod(op->loop, "call_soon_threadsafe", "OOOO", setFutureResult, op->future, result, op->device);
+        if (!rc)
+            PyErr_WriteUnraisable(op->future);
+        Py_XDECREF(rc);
+    }
+    Py_XDECREF(result);
+    asyncOpFree(op);
+}
+
+#ifdef WIN32
+// no selector based notification with proactor loops - completed directly
+// from the worker thread through loop.call_soon_threadsafe
+static void asyncOpDone(DeviceOp* op)
+{
+    PyGILState_STATE gil = PyGILState_Ensure();
+    asyncOpComplete(op, NULL);
+    PyGILState_Release(gil);
+}
+
+static int asyncWatchLoop(PyObject* module, PyObject* loop)
+{
+    (void)module;
+    (void)loop;
+    return 0;
+}
+
+#else
+static std::mutex asyncMutex;
+static std::deque<DeviceOp*> asyncCompleted;
+static int asyncNotifyFd[2] = {-1, -1};   // read end, write end
+
+static int asyncNotifierInit()
+{
+    if (asyncNotifyFd[0] >= 0)
+        return 0;
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    asyncNotifyFd[0] = asyncNotifyFd[1] = fd;
+#else
+    if (pipe(asyncNotifyFd) < 0)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(asyncNotifyFd[i], F_SETFL, fcntl(asyncNotifyFd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(asyncNotifyFd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    return 0;
+}
+
+static void asyncOpDone(DeviceOp* op)
+{
+    {
+        std::lock_guard<std::mutex> lock(asyncMutex);
+        asyncCompleted.push_back(op);
+    }
+    unsigned long long one = 1;
+    ssize_t rc = write(asyncNotifyFd[1], &one, asyncNotifyFd[0] == asyncNotifyFd[1] ? sizeof(one) : 1);
+    (void)rc;
+}
+
+// reader callback of the event loop - completes all finished operations
+static PyObject* module_asyncDrain(PyObject* self, PyObject* loop)
+{
+    (void)self;
+    char buff[64];
+    ssize_t rc = 0;
+    if (asyncNotifyFd[0] == asyncNotifyFd[1])
+        rc = read(asyncNotifyFd[0], buff, sizeof(unsigned long long));
+    else
+        while ((rc = read(asyncNotifyFd[0], buff, sizeof(buff))) > 0);
+    (void)rc;
+
+    std::deque<DeviceOp*> completed;
+    {
+        std::lock_guard<std::mutex> lock(asyncMutex);
+        completed.swap(asyncCompleted);
+    }
+    for (size_t i = 0; i < completed.size(); i++)
+        asyncOpComplete(completed[i], loop);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef asyncDrainDef = {"_async_drain", (PyCFunction)module_asyncDrain, METH_O, NULL};
+
+// registers the notifier fd as reader in the loop (once per loop)
+static int asyncWatchLoop(PyObject* module, PyObject* loop)
+{
+    PyObject* asyncLoops = moduleState(module)->asyncLoops;
+    int contains = PySet_Contains(asyncLoops, loop);
+    if (contains != 0)
+        return contains;
+
+    if (asyncNotifierInit() < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    PyObject* drain = PyCFunction_New(&asyncDrainDef, module);
+    if (!drain)
+        return -1;
+    PyObject* rc = PyObject_CallMethod(loop, "add_reader", "iOO", asyncNotifyFd[0], drain, loop);
+    Py_DECREF(drain);
+    if (!rc)
+        return -1;
+    Py_DECREF(rc);
+
+    // forget closed loops
+    PyObject* loops = PySequence_List(asyncLoops);
+    for (Py_ssize_t i = 0; loops && i < PyList_GET_SIZE(loops); i++) {
+        PyObject* closed = PyObject_CallMethod(PyList_GET_ITEM(loops, i), "is_closed", NULL);
+        if (closed == Py_True)
+            PySet_Discard(asyncLoops, PyList_GET_ITEM(loops, i));
+        Py_XDECREF(closed);
+    }
+    Py_XDECREF(loops);
+    PyErr_Clear();
+    return PySet_Add(asyncLoops, loop);
+}
+#endif
+
+static PyObject* module_setFutureResult(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+{
+    (void)self;
+    if (nargs < 2) {
+        PyErr_SetString(PyExc_TypeError, "_set_future_result(future, result, ...)");
+        return NULL;
+    }
+    PyObject* done = PyObject_CallMethod(args[0], "done", NULL);
+    if (!done)
+        return NULL;
+    int isDone = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    if (isDone)   // cancelled
+        Py_RETURN_NONE;
+    return PyObject_CallMethod(args[0], "set_result", "O", args[1]);
+}
+
+// creates operation with a new future of the running event loop
+static DeviceOp* asyncOpNew(Device* self, PyTypeObject* cls, DeviceOp::Kind kind)
+{
+    PyObject* module = PyType_GetModule(cls);
+    if (!module)
+        return NULL;
+    ModuleState* state = moduleState(module);
+
+    PyObject* loop = NULL;
+    Py_BEGIN_CRITICAL_SECTION(module);
+    if (!state->getRunningLoop) {
+        PyObject* asyncio = PyImport_ImportModule("asyncio");
+        if (asyncio) {
+            state->getRunningLoop = PyObject_GetAttrString(asyncio, "get_running_loop");
+            Py_DECREF(asyncio);
+        }
+    }
+    if (state->getRunningLoop)
+        loop = PyObject_CallNoArgs(state->getRunningLoop);
+    if (loop && asyncWatchLoop(module, loop) < 0)
+        Py_CLEAR(loop);
+    Py_END_CRITICAL_SECTION();
+    if (!loop)
+        return NULL;
+
+    PyObject* future = PyObject_CallMethod(loop, "create_future", NULL);
+    if (!future) {
+        Py_DECREF(loop);
+        return NULL;
+    }
+
+    DeviceOp* op = new DeviceOp();
+    op->kind = kind;
+    op->device = self;
+    Py_INCREF(self);
+    op->module = module;
+    Py_INCREF(module);
+    op->future = future;
+    op->loop = loop;
+    op->data = NULL;
+    op->latch = NULL;
+    op->size = 0;
+    op->timeout = 2;
+    op->rc = 0;
+    return op;
+}
+
+static PyObject* device_readAsync(Device* self, PyTypeObject* cls, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    static const char* const kwlist[] = {"size", "timeout", NULL};
+    PyObject* values[2];
+    Py_ssize_t size;
+    double timeout;
+    if (!pyParseArgs(args, nargs, kwnames, "read_async", kwlist, 2, values) || !pyArgSize(values[0], &size)
+        || !pyArgDouble(values[1], &timeout))
+        return NULL;
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid size.");
+        return NULL;
+    }
+
+    PyObject* data = PyBytes_FromStringAndSize(NULL, size);
+    if (!data)
+        return NULL;
+    DeviceOp* op = asyncOpNew(self, cls, DeviceOp::OP_READ);
+    if (!op) {
+        Py_DECREF(data);
+        return NULL;
+    }
+    op->data = data;
+    op->size = (size_t)size;
+    op->timeout = timeout;
+
+    PyObject* future = op->future;
+    Py_INCREF(future);
+    deviceWorkerSubmit(self, op);
+    return future;
+}
+
+static PyObject* device_sendAsync(Device* self, PyTypeObject* cls, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    static const char* const kwlist[] = {"data", "timeout", NULL};
+    PyObject* values[2];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "send_async", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
+        return NULL;
+
+    Py_buffer view;
+    if (getDataBuffer(values[0], &view) < 0)
+        return NULL;
+
+    DeviceOp* op = asyncOpNew(self, cls, DeviceOp::OP_SEND);
+    if (!op) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    op->view = view;
+    op->size = (size_t)view.len;
+    op->timeout = timeout;
+
+    PyObject* future = op->future;
+    Py_INCREF(future);
+    deviceWorkerSubmit(self, op);
+    return future;
+}
+
+
+static PyMethodDef device_methods[] =
+{
+    {"list_devices", (PyCFunction)device_listDevices, METH_NOARGS, "list_devices()"},
+    {"open", PyFastCFunction(device_open), METH_FASTCALL | METH_KEYWORDS, "open(dev_name,baud,interface_index)"},
+    {"close", (PyCFunction)device_close, METH_NOARGS, "close()"},
+    {"set_sync_mode", PyFastCFunction(device_setSyncMode), METH_FASTCALL | METH_KEYWORDS, "set_sync_mode(is_sync_mode)"},
+    {"set_read_pipeline", PyFastCFunction(device_setReadPipeline), METH_FASTCALL | METH_KEYWORDS, "set_read_pipeline(depth, transfer_size=65536)"},
+    {"start_reader", PyFastCFunction(device_startReader), METH_FASTCALL | METH_KEYWORDS, "start_reader(ring_size=4194304)"},
+    {"stop_reader", (PyCFunction)device_stopReader, METH_NOARGS, "stop_reader()"},
+    {"in_queue", (PyCFunction)device_inQueue, METH_NOARGS, "in_queue()"},
+    {"start_writer", PyFastCFunction(device_startWriter), METH_FASTCALL | METH_KEYWORDS, "start_writer(queue_size=1048576, timeout=2)"},
+    {"stop_writer", (PyCFunction)device_stopWriter, METH_NOARGS, "stop_writer()"},
+    {"flush", PyFastCFunction(device_flush), METH_FASTCALL | METH_KEYWORDS, "flush(timeout=2)"},
+    {"wait_sent", PyFastCFunction(device_waitSent), METH_FASTCALL | METH_KEYWORDS, "wait_sent(token, timeout=2)"},
+    {"tx_token", (PyCFunction)device_txToken, METH_NOARGS, "tx_token()"},
+    {"is_connected", (PyCFunction)device_isConnected, METH_NOARGS, "is_connected()"},
+    {"clear_buffers", (PyCFunction)device_clearBuffers, METH_NOARGS, "clear_buffers()"},
+    {"send", PyFastCFunction(device_send), METH_FASTCALL | METH_KEYWORDS, "send(data)"},
+    {"send_parts", PyFastCFunction(device_sendParts), METH_FASTCALL | METH_KEYWORDS, "send_parts(parts, timeout=2)"},
+    {"read", PyFastCFunction(device_read), METH_FASTCALL | METH_KEYWORDS, "read(size, timeout, as_list=False)"},
+    {"read_into", PyFastCFunction(device_readInto), METH_FASTCALL | METH_KEYWORDS, "read_into(buffer, timeout)"},
+    {"read_until", PyFastCFunction(device_readUntil), METH_FASTCALL | METH_KEYWORDS, "read_until(pattern, max_size, timeout=2)"},
+    {"skip_until", PyFastCFunction(device_skipUntil), METH_FASTCALL | METH_KEYWORDS, "skip_until(pattern, timeout=2)"},
+    {"expect", PyFastCFunction(device_expect), METH_FASTCALL | METH_KEYWORDS, "expect(patterns, timeout=2)"},
+    {"readlines", PyFastCFunction(device_readLines), METH_FASTCALL | METH_KEYWORDS, "readlines(max_lines=0, timeout=2, sep=b'\\n')"},
+    {"set_framing", PyFastCFunction(device_setFraming), METH_FASTCALL | METH_KEYWORDS, "set_framing(kind, size=0, length_offset=0, length_width=1, endianness='little', length_adjust=0, delimiter=b'', sync=b'', max_size=0)"},
+    {"read_frames", PyFastCFunction(device_readFrames), METH_FASTCALL | METH_KEYWORDS, "read_frames(max_frames=0, timeout=2)"},
+    {"framing_dropped", (PyCFunction)device_framingDropped, METH_NOARGS, "framing_dropped()"},
+    {"readline", PyFastCFunction(device_readLine), METH_FASTCALL | METH_KEYWORDS, "readline(sep=b'\\n', timeout=2)"},
+    {"read_array", PyFastCFunction(device_readArray), METH_FASTCALL | METH_KEYWORDS, "read_array(count, dtype, endianness, timeout)"},
+    {"send_array", PyFastCFunction(device_sendArray), METH_FASTCALL | METH_KEYWORDS, "send_array(array, endianness)"},
+    {"transact", PyFastCFunction(device_transact), METH_FASTCALL | METH_KEYWORDS, "transact(items, timeout=2, window=0)"},
+    {"exchange", PyFastCFunction(device_exchange), METH_FASTCALL | METH_KEYWORDS, "exchange(data, timeout=2, window=0)"},
+    {"stream", PyFastCFunction(device_stream), METH_METHOD | METH_FASTCALL | METH_KEYWORDS, "stream(chunk_size, timeout=2, buffers=4) -> iterator of memoryviews"},
+    {"set_on_data", PyFastCFunction(device_setOnData), METH_FASTCALL | METH_KEYWORDS, "set_on_data(callback, max_batch_bytes=65536, max_latency_ms=50, tx=False)"},
+    {"start_fifo_stream", PyFastCFunction(device_startFifoStream), METH_FASTCALL | METH_KEYWORDS, "start_fifo_stream(callback, max_batch_bytes=1048576, max_latency_ms=50, packets_per_transfer=8, num_transfers=256)"},
+    {"stop_fifo_stream", (PyCFunction)device_stopFifoStream, METH_NOARGS, "stop_fifo_stream()"},
+    {"fifo_stream_stats", (PyCFunction)device_fifoStreamStats, METH_NOARGS, "fifo_stream_stats()"},
+    {"read_async", PyFastCFunction(device_readAsync), METH_METHOD | METH_FASTCALL | METH_KEYWORDS, "read_async(size, timeout) -> awaitable"},
+    {"send_async", PyFastCFunction(device_sendAsync), METH_METHOD | METH_FASTCALL | METH_KEYWORDS, "send_async(data, timeout=2) -> awaitable"},
+    { NULL }
+};
+
+static PyType_Slot device_slots[] =
+{
+    {Py_tp_new, (void*)device_new},
+    {Py_tp_init, (void*)device_init},
+    {Py_tp_dealloc, (void*)device_dealloc},
+    {Py_tp_methods, device_methods},
+    {Py_tp_doc, (void*)"Device object"},
+    {0, NULL}
+};
+
+static PyType_Spec device_spec =
+{
+    "py_ftdi.Device",                           /* name */
+    sizeof(Device),                             /* basicsize */
+    0,                                          /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* flags */
+    device_slots,                               /* slots */
+};
+
+
+//################################################################################
+//                      DEVICE GROUP
+//################################################################################
+
+// DeviceGroup runs the same operation on several devices at once. The operations
+// are executed by the worker threads of the devices (the same ones that serve
+// read_async/send_async), the caller waits for all of them with the GIL released,
+// so the group takes about as long as its slowest device.
+typedef struct {
+    PyObject_HEAD
+    PyObject* devices;      // tuple of Device
+} DeviceGroup;
+
+static PyObject* group_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = {"devices", NULL};
+    PyObject* devices;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", (char**)kwlist, &devices))
+        return NULL;
+
+    PyObject* module = PyType_GetModule(type);
+    if (!module)
+        return NULL;
+    PyTypeObject* deviceType = (PyTypeObject*)moduleState(module)->deviceType;
+
+    PyObject* tuple = PySequence_Tuple(devices);
+    if (!tuple)
+        return NULL;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(tuple); i++) {
+        if (!PyObject_TypeCheck(PyTuple_GET_ITEM(tuple, i), deviceType)) {
+            Py_DECREF(tuple);
+            PyErr_SetString(PyExc_TypeError, "devices must be Device objects");
+            return NULL;
+        }
+    }
+
+    DeviceGroup* self = (DeviceGroup*)type->tp_alloc(type, 0);
+    if (!self) {
+        Py_DECREF(tuple);
+        return NULL;
+    }
+    self->devices = tuple;
+    return (PyObject*)self;
+}
+
+static void group_dealloc(DeviceGroup* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    Py_XDECREF(self->devices);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+// payload of each device - one buffer for all, or a list/tuple with item for each device
+static int groupPayloads(DeviceGroup* self, PyObject* data, std::vector<DeviceOp*>& ops)
+{
+    Py_ssize_t count = PyTuple_GET_SIZE(self->devices);
+    bool each = (PyList_Check(data) || PyTuple_Check(data)) && PySequence_Fast_GET_SIZE(data) > 0
+        && !PyLong_Check(PySequence_Fast_GET_ITEM(data, 0));
+    if (each && PySequence_Fast_GET_SIZE(data) != count) {
+        PyErr_SetString(PyExc_ValueError, "Number of payloads does not match number of devices.");
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (getDataBuffer(each ? PySequence_Fast_GET_ITEM(data, i) : data, &ops[i]->view) < 0)
+            return -1;
+        ops[i]->data = NULL;
+        ops[i]->size = (size_t)ops[i]->view.len;
+    }
+    return 0;
+}
+
+// response size of each device - one size for all, or sequence of sizes
+static int groupSizes(DeviceGroup* self, PyObject* size, std::vector<DeviceOp*>& ops)
+{
+    Py_ssize_t count = PyTuple_GET_SIZE(self->devices);
+    PyObject* seq = NULL;
+    if (!PyLong_Check(size)) {
+        seq = PySequence_Fast(size, "size must be int or sequence of ints");
+        if (!seq)
+            return -1;
+        if (PySequence_Fast_GET_SIZE(seq) != count) {
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_ValueError, "Number of sizes does not match number of devices.");
+            return -1;
+        }
+    }
+
+    int rc = 0;
+    for (Py_ssize_t i = 0; i < count && rc == 0; i++) {
+        Py_ssize_t itemSize;
+        if (!pyArgSize(seq ? PySequence_Fast_GET_ITEM(seq, i) : size, &itemSize)) {
+            rc = -1;
+        } else if (itemSize < 0) {
+            PyErr_SetString(PyExc_ValueError, "Invalid size.");
+            rc = -1;
+        } else {
+            ops[i]->data = PyBytes_FromStringAndSize(NULL, itemSize);
+            ops[i]->size = (size_t)itemSize;
+            if (!ops[i]->data)
+                rc = -1;
+        }
+    }
+    Py_XDECREF(seq);
+    return rc;
+}
+
+static void groupOpsFree(std::vector<DeviceOp*>& ops)
+{
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (ops[i]->kind != DeviceOp::OP_READ && ops[i]->view.obj)
+            PyBuffer_Release(&ops[i]->view);
+        Py_XDECREF(ops[i]->data);
+        Py_DECREF(ops[i]->device);
+        delete ops[i];
+    }
+    ops.clear();
+}
+
+// runs the operation on all devices, returns list of rc (send) or [rc, bytes] (read, transact)
+static PyObject* groupRun(DeviceGroup* self, DeviceOp::Kind kind, PyObject* data, PyObject* size, double timeout)
+{
+    Py_ssize_t count = PyTuple_GET_SIZE(self->devices);
+    DeviceOpLatch latch;
+    latch.pending = (size_t)count;
+    std::vector<DeviceOp*> ops((size_t)count);
+    for (Py_ssize_t i = 0; i < count; i++) {
+        DeviceOp* op = new DeviceOp();
+        op->kind = kind;
+        op->device = (Device*)PyTuple_GET_ITEM(self->devices, i);
+        Py_INCREF(op->device);
+        op->module = op->future = op->loop = op->data = NULL;
+        op->view.obj = NULL;
+        op->latch = &latch;
+        op->size = 0;
+        op->timeout = timeout;
+        op->rc = 0;
+        ops[i] = op;
+    }
+
+    if ((data && groupPayloads(self, data, ops) < 0) || (size && groupSizes(self, size, ops) < 0)) {
+        groupOpsFree(ops);
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++)
+        deviceWorkerSubmit(ops[i]->device, ops[i]);
+    Py_BEGIN_ALLOW_THREADS
+    std::unique_lock<std::mutex> lock(latch.mutex);
+    latch.cond.wait(lock, [&latch]{ return latch.pending == 0; });
+    Py_END_ALLOW_THREADS
+
+    PyObject* results = PyList_New(count);
+    for (Py_ssize_t i = 0; results && i < count; i++) {
+        DeviceOp* op = ops[i];
+        PyObject* item;
+        if (kind == DeviceOp::OP_SEND) {
+            item = PyLong_FromLong(op->rc);
+        } else if (_PyBytes_Resize(&op->data, op->rc > 0 ? op->rc : 0) < 0) {
+            item = NULL;
+        } else {
+            item = PyList_New(2);
+            PyList_SET_ITEM(item, 0, PyLong_FromLong(op->rc));
+            PyList_SET_ITEM(item, 1, op->data);
+            op->data = NULL;
+        }
+        if (!item)
+            Py_CLEAR(results);
+        else
+            PyList_SET_ITEM(results, i, item);
+    }
+    groupOpsFree(ops);
+    return results;
+}
+
+static PyObject* group_send(DeviceGroup* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"data", "timeout", NULL};
+    PyObject* values[2];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "send", kwlist, 1, values)
+        || (values[1] && !pyArgDouble(values[1], &timeout)))
+        return NULL;
+    return groupRun(self, DeviceOp::OP_SEND, values[0], NULL, timeout);
+}
+
+static PyObject* group_read(DeviceGroup* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"size", "timeout", NULL};
+    PyObject* values[2];
+    double timeout;
+    if (!pyParseArgs(args, nargs, kwnames, "read", kwlist, 2, values) || !pyArgDouble(values[1], &timeout))
+        return NULL;
+    return groupRun(self, DeviceOp::OP_READ, NULL, values[0], timeout);
+}
+
+static PyObject* group_transact(DeviceGroup* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* const kwlist[] = {"data", "size", "timeout", NULL};
+    PyObject* values[3];
+    double timeout = 2;
+    if (!pyParseArgs(args, nargs, kwnames, "transact", kwlist, 2, values)
+        || (values[2] && !pyArgDouble(values[2], &timeout)))
+        return NULL;
+    return groupRun(self, DeviceOp::OP_TRANSACT, values[0], values[1], timeout);
+}
+
+static PyObject* group_getDevices(DeviceGroup* self, void* Py_UNUSED(closure))
+{
+    Py_INCREF(self->devices);
+    return self->devices;
+}
+
+static Py_ssize_t group_length(DeviceGroup* self)
+{
+    return PyTuple_GET_SIZE(self->devices);
+}
+
+static PyMethodDef group_methods[] =
+{
+    {"send", PyFastCFunction(group_send), METH_FASTCALL | METH_KEYWORDS, "send(data, timeout=2)"},
+    {"read", PyFastCFunction(group_read), METH_FASTCALL | METH_KEYWORDS, "read(size, timeout)"},
+    {"transact", PyFastCFunction(group_transact), METH_FASTCALL | METH_KEYWORDS, "transact(data, size, timeout=2)"},
+    { NULL }
+};
+
+static PyGetSetDef group_getset[] =
+{
+    {"devices", (getter)group_getDevices, NULL, "devices of the group", NULL},
+    { NULL }
+};
+
+static PyType_Slot group_slots[] =
+{
+    {Py_tp_new, (void*)group_new},
+    {Py_tp_dealloc, (void*)group_dealloc},
+    {Py_tp_methods, group_methods},
+    {Py_tp_getset, group_getset},
+    {Py_sq_length, (void*)group_length},
+    {Py_tp_doc, (void*)"DeviceGroup(devices) - parallel operations on several devices"},
+    {0, NULL}
+};
+
+static PyType_Spec group_spec =
+{
+    "py_ftdi.DeviceGroup",                      /* name */
+    sizeof(DeviceGroup),                        /* basicsize */
+    0,                                          /* itemsize */
+    Py_TPFLAGS_DEFAULT,                         /* flags */
+    group_slots,                                /* slots */
+};
+
+
+//################################################################################
+//                      INIT MODULE
+//################################################################################
+
+static PyMethodDef module_methods[] = {
+    {"list_devices", (PyCFunction)device_listDevices, METH_NOARGS, "list_devices()"},
+    {"_set_future_result", PyFastCFunction(module_setFutureResult), METH_FASTCALL, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static int module_exec(PyObject* m)
+{
+    ModuleState* state = moduleState(m);
+    state->asyncLoops = PySet_New(NULL);
+    state->setFutureResult = PyObject_GetAttrString(m, "_set_future_result");
+    state->deviceType = PyType_FromModuleAndSpec(m, &device_spec, NULL);
+    state->streamType = PyType_FromModuleAndSpec(m, &stream_spec, NULL);
+    state->chunkType = PyType_FromModuleAndSpec(m, &chunk_spec, NULL);
+    state->groupType = PyType_FromModuleAndSpec(m, &group_spec, NULL);
+    if (!state->asyncLoops || !state->setFutureResult || !state->deviceType || !state->streamType || !state->chunkType
+        || !state->groupType)
+        return -1;
+
+    if (PyModule_AddObjectRef(m, "Device", state->deviceType) < 0
+        || PyModule_AddObjectRef(m, "DeviceGroup", state->groupType) < 0)
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "DT_CHAR", DT_CHAR) < 0
+        || PyModule_AddIntConstant(m, "DT_BYTE", DT_BYTE) < 0
+        || PyModule_AddIntConstant(m, "DT_I16", DT_I16) < 0
+        || PyModule_AddIntConstant(m, "DT_U16", DT_U16) < 0
+        || PyModule_AddIntConstant(m, "DT_I32", DT_I32) < 0
+        || PyModule_AddIntConstant(m, "DT_U32", DT_U32) < 0
+        || PyModule_AddIntConstant(m, "DT_I64", DT_I64) < 0
+        || PyModule_AddIntConstant(m, "DT_U64", DT_U64) < 0
+        || PyModule_AddIntConstant(m, "DT_FLOAT", DT_FLOAT) < 0
+        || PyModule_AddIntConstant(m, "DT_DOUBLE", DT_DOUBLE) < 0
+        || PyModule_AddIntConstant(m, "DT_BOOL", DT_BOOL) < 0)
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "FRAME_NONE", FtdiFrameFormat::FRAME_NONE) < 0
+        || PyModule_AddIntConstant(m, "FRAME_FIXED", FtdiFrameFormat::FRAME_FIXED) < 0
+        || PyModule_AddIntConstant(m, "FRAME_LENGTH", FtdiFrameFormat::FRAME_LENGTH) < 0
+        || PyModule_AddIntConstant(m, "FRAME_DELIMITER", FtdiFrameFormat::FRAME_DELIMITER) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int module_traverse(PyObject* m, visitproc visit, void* arg)
+{
+    ModuleState* state = moduleState(m);
+    Py_VISIT(state->deviceType);
+    Py_VISIT(state->streamType);
+    Py_VISIT(state->chunkType);
+    Py_VISIT(state->groupType);
+    Py_VISIT(state->getRunningLoop);
+    Py_VISIT(state->setFutureResult);
+    Py_VISIT(state->asyncLoops);
+    return 0;
+}
+
+static int module_clear(PyObject* m)
+{
+    ModuleState* state = moduleState(m);
+    Py_CLEAR(state->deviceType);
+    Py_CLEAR(state->streamType);
+    Py_CLEAR(state->chunkType);
+    Py_CLEAR(state->groupType);
+    Py_CLEAR(state->getRunningLoop);
+    Py_CLEAR(state->setFutureResult);
+    Py_CLEAR(state->asyncLoops);
+    return 0;
+}
+
+static void module_free(void* m)
+{
+    module_clear((PyObject*)m);
+}
+
+// The async completion queue and its notifier are process wide, so the module
+// cannot be shared by subinterpreters. Without the GIL devices are guarded by
+// their locks and FtdiDev guards its static tables itself.
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, (void*)module_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_NOT_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "py_ftdi",           /* m_name */
+    "Interface to ftdi",    /* m_doc */
+    sizeof(ModuleState),    /* m_size */
+    module_methods,    /* m_methods */
+    module_slots,        /* m_slots */
+    module_traverse,     /* m_traverse */
+    module_clear,        /* m_clear */
+    module_free,         /* m_free */
+};
+
+PyMODINIT_FUNC PyInit_py_ftdi(void)
+{
+    return PyModuleDef_Init(&moduledef);
 }
 
 PyMODINIT_FUNC PyInit_py_ftdi_linux(void)
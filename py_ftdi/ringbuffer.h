@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2023 Daniel Turecek
+ *
+ * @file      ringbuffer.h
+ * @author    Daniel Turecek <daniel@turecek.de>
+ * @date      2023-02-05
+ *
+ */
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+// Lock-free ring buffer for one producer and one consumer thread. The capacity is
+// rounded up to a power of two. clear() may be called only when the producer is
+// not running.
+template <class T> class RingBuffer
+{
+public:
+    RingBuffer(size_t capacity = 0)
+        : mBuff(0)
+        , mCapacity(0)
+        , mHead(0)
+        , mTail(0)
+    {
+        if (capacity)
+            reinit(capacity);
+    }
+
+    ~RingBuffer(){
+        delete[] mBuff;
+    }
+
+    void reinit(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        delete[] mBuff;
+        mBuff = new T[size];
+        mCapacity = size;
+        clear();
+    }
+
+    void clear() {
+        mHead.store(0, std::memory_order_relaxed);
+        mTail.store(0, std::memory_order_release);
+    }
+
+    // producer: copies at most count items, returns number of written items
+    size_t write(const T* data, size_t count) {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        size_t tail = mTail.load(std::memory_order_acquire);
+        count = std::min(count, mCapacity - (head - tail));
+        size_t pos = head & (mCapacity - 1);
+        size_t first = std::min(count, mCapacity - pos);
+        memcpy(mBuff + pos, data, first * sizeof(T));
+        memcpy(mBuff, data + first, (count - first) * sizeof(T));
+        mHead.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // producer: contiguous free space to write to directly, committed by produce()
+    size_t writeSpan(T** ptr) {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        size_t tail = mTail.load(std::memory_order_acquire);
+        size_t pos = head & (mCapacity - 1);
+        *ptr = mBuff + pos;
+        return std::min(mCapacity - (head - tail), mCapacity - pos);
+    }
+
+    void produce(size_t count) {
+        mHead.store(mHead.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    // consumer: copies at most count items, returns number of read items
+    size_t read(T* data, size_t count) {
+        count = peek(data, count);
+        consume(count);
+        return count;
+    }
+
+    // consumer: copies at most count items starting at offset without removing them
+    size_t peek(T* data, size_t count, size_t offset = 0) const {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        size_t head = mHead.load(std::memory_order_acquire);
+        if (offset >= head - tail)
+            return 0;
+        count = std::min(count, head - tail - offset);
+        size_t pos = (tail + offset) & (mCapacity - 1);
+        size_t first = std::min(count, mCapacity - pos);
+        memcpy(data, mBuff + pos, first * sizeof(T));
+        memcpy(data + first, mBuff, (count - first) * sizeof(T));
+        return count;
+    }
+
+    // consumer: contiguous available items to read directly, released by consume()
+    size_t readSpan(const T** ptr) const {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        size_t head = mHead.load(std::memory_order_acquire);
+        size_t pos = tail & (mCapacity - 1);
+        *ptr = mBuff + pos;
+        return std::min(head - tail, mCapacity - pos);
+    }
+
+    void consume(size_t count) {
+        mTail.store(mTail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    size_t available() const { return mHead.load(std::memory_order_acquire) - mTail.load(std::memory_order_acquire); }
+    size_t space() const { return mCapacity - available(); }
+    size_t capacity() const { return mCapacity; }
+    bool empty() const { return available() == 0; }
+
+private:
+    RingBuffer(const RingBuffer<T> &);
+    RingBuffer<T> & operator=(const RingBuffer<T> &);
+
+private:
+    T* mBuff;
+    size_t mCapacity;
+    std::atomic<size_t> mHead;  // written by producer
+    std::atomic<size_t> mTail;  // written by consumer
+};
+
+#endif /* end of include guard: RINGBUFFER_H */
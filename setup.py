@@ -30,7 +30,8 @@ def main():
 
 
     setup(name="py_ftdi",
-            version="1.1.3",
+            version="1.2.0",
+            python_requires=">=3.10",
             description="FTDI library",
             author="Daniel Turecek",
             author_email="daniel@turecek.de",
@@ -45,7 +46,8 @@ def main():
                  Extension(
                     "py_ftdi",
                     sources=["py_ftdi/py_ftdi.cpp",
-                             "py_ftdi/ftdidev.cpp" ],
+                             "py_ftdi/ftdidev.cpp",
+                             "py_ftdi/dataconv.cpp" ],
                     define_macros=define_macros,
                     include_dirs=include_dirs,
                     extra_objects=extra_objects
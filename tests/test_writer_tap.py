@@ -0,0 +1,56 @@
+# Toggles the data tap while the background writer sends data.
+# Needs a connected device: PY_FTDI_DEVICE=<device name> python3 -m unittest tests/test_writer_tap.py
+import os
+import threading
+import time
+import unittest
+
+import py_ftdi
+
+DEVICE = os.environ.get("PY_FTDI_DEVICE")
+
+
+@unittest.skipUnless(DEVICE, "PY_FTDI_DEVICE not set")
+class WriterTapTest(unittest.TestCase):
+    def setUp(self):
+        self.device = py_ftdi.Device()
+        self.assertGreaterEqual(self.device.open(DEVICE, 0, 0), 0)
+        self.assertEqual(self.device.start_writer(4096), 0)
+
+    def tearDown(self):
+        self.device.stop_writer()
+        self.device.set_on_data(None)
+        self.device.close()
+
+    def test_toggle_tap_while_writing(self):
+        sent = bytearray()
+        done = threading.Event()
+
+        def on_data(data, tx):
+            if tx:
+                sent.extend(data)
+
+        def toggle():
+            while not done.is_set():
+                self.device.set_on_data(on_data, max_latency_ms=1, tx=True)
+                time.sleep(0.001)
+                self.device.set_on_data(None)
+
+        toggler = threading.Thread(target=toggle)
+        toggler.start()
+        try:
+            chunk = bytes(range(256)) * 4
+            for _ in range(500):
+                self.assertEqual(self.device.send(chunk), len(chunk))
+            self.assertEqual(self.device.flush(), 0)
+        finally:
+            done.set()
+            toggler.join()
+
+        # the tap sees whole sends only, each reported once
+        self.assertEqual(len(sent) % len(chunk), 0)
+        self.assertLessEqual(len(sent), 500 * len(chunk))
+
+
+if __name__ == "__main__":
+    unittest.main()